@@ -143,16 +143,20 @@ namespace CA {
             using Transition = TransitionT<SymbolT>;
             using Transitions = std::vector<Transition>;
 
-            StateT () : transitions_(), cnt_(0), final_(Guard::False) {}
-            StateT (CounterId cnt) : transitions_(), cnt_(cnt), final_(Guard::False) {}
+            StateT () : transitions_(), cnt_(0), final_(Guard::False), end_only_(false) {}
+            StateT (CounterId cnt) : transitions_(), cnt_(cnt), final_(Guard::False), end_only_(false) {}
 
             void add_transition(Transition &&trans) { transitions_.push_back(trans); }
 
             [[nodiscard]] Transitions const& transitions() const { return transitions_; }
             [[nodiscard]] Guard final() const { return final_; }
             [[nodiscard]] CounterId cnt() const { return cnt_; } 
+            // final only at the end of the text, because of an end anchor
+            [[nodiscard]] bool end_only() const { return end_only_; }
 
-            void set_final(Counters const &cnts) { 
+            void set_final(Counters const &cnts, bool end_only = false) { 
+                // final without an anchor wins
+                end_only_ = end_only && (final_ == Guard::False || end_only_);
                 if (cnt_ && cnts[cnt_ - 1].min() != 0) {
                     final_ = Guard::CanExit; 
                 } else {
@@ -187,6 +191,7 @@ namespace CA {
             Transitions transitions_;
             CounterId cnt_;
             Guard final_;
+            bool end_only_;
     };
 
 
@@ -197,7 +202,8 @@ namespace CA {
         using States = std::vector<State>;
 
 
-        CA() : counters_(), states_({State()}), bytemap_(), bytemap_range_(0) { }
+        CA() : counters_(), states_({State()}), bytemap_(), bytemap_range_(0),
+            any_loop_start_(InitState) { }
 
         [[nodiscard]] State& get_state(StateId id) { 
             assert(id < states_.size()); 
@@ -249,6 +255,11 @@ namespace CA {
         }
 
         void set_bytemap_range(uint8_t range) { bytemap_range_ = range; }
+
+        // state looping on any symbol in front of unanchored patterns,
+        // InitState if the pattern is anchored
+        [[nodiscard]] StateId any_loop_start() const { return any_loop_start_; }
+        void set_any_loop_start(StateId state) { any_loop_start_ = state; }
         void set_bytemap(uint8_t const* bytemap) { 
             for (unsigned i = 0; i < ByteMapSize; i++) {
                 bytemap_[i] = bytemap[i];
@@ -338,5 +349,6 @@ namespace CA {
             // bytemap
             uint8_t bytemap_[ByteMapSize];
             uint8_t bytemap_range_;
+            StateId any_loop_start_;
     };
 }
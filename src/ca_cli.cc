@@ -1,16 +1,34 @@
 #include "argparse.hpp"
 
 #include "csa.hh"
+#include "csa_parallel.hh"
+#include "csa_server.hh"
+#include "csa_set.hh"
+#include "csa_shared.hh"
+#include "csa_stream.hh"
 #include "glushkov.hh"
+#include "prefilter.hh"
 
 #include <iostream>
 #include <stdexcept>
 #include <string_view>
+#include <csignal>
+#include <cstdio>
 #include <fstream>
+#include <iterator>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
 
 using namespace std::string_literals;
 
-void count_lines(std::string_view pattern, std::string file) {
+// capacity of the shared cache segment created by the first process
+const size_t shared_cache_capacity = 64 << 20;
+
+void count_lines(std::string_view pattern, std::string file,
+        std::optional<std::string> const& shared_cache) {
     std::ifstream input(file);
 
     if (!input.is_open()) {
@@ -19,6 +37,12 @@ void count_lines(std::string_view pattern, std::string file) {
     }
 
     CSA::Matcher matcher(pattern);
+    // starts from the states computed by the other processes
+    std::optional<CSA::SharedCache> cache;
+    if (shared_cache) {
+        cache.emplace(*shared_cache, pattern, matcher.csa(), shared_cache_capacity);
+        cache->import(matcher.csa());
+    }
     std::string line;
     unsigned matches = 0;
     while (getline(input, line)) {
@@ -26,10 +50,237 @@ void count_lines(std::string_view pattern, std::string file) {
             ++matches;
         }
     }
+    if (cache && !cache->publish(matcher.csa())) {
+        std::cerr << "The shared cache " << *shared_cache << " is full\n";
+    }
 
     std::cout << matches << std::endl;
 }
 
+std::vector<std::string> read_patterns(std::string const& file) {
+    std::ifstream input(file);
+
+    if (!input.is_open()) {
+        std::cerr << "Failed to open file " << file << '\n';
+        std::exit(1);
+    }
+
+    std::vector<std::string> patterns;
+    std::string line;
+    while (getline(input, line)) {
+        if (!line.empty()) {
+            patterns.push_back(std::move(line));
+        }
+    }
+    return patterns;
+}
+
+// length of the valid UTF-8 sequence at the start of str, 0 if it is not
+size_t utf8_length(std::string_view str) {
+    auto byte = [&](size_t i) { return static_cast<unsigned char>(str[i]); };
+    unsigned char c = byte(0);
+    size_t len = c < 0x80 ? 1 : c < 0xc2 ? 0 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf5 ? 4 : 0;
+    if (len == 0 || len > str.size()) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        if ((byte(i) & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    // overlong forms, surrogates and code points above U+10FFFF
+    if ((c == 0xe0 && byte(1) < 0xa0) || (c == 0xed && byte(1) >= 0xa0)
+            || (c == 0xf0 && byte(1) < 0x90) || (c == 0xf4 && byte(1) >= 0x90)) {
+        return 0;
+    }
+    return len;
+}
+
+// the bytes that are not valid UTF-8 are replaced by U+FFFD, so the
+// output is always valid JSON
+std::string json_escape(std::string_view str) {
+    std::string res;
+    for (size_t i = 0; i < str.size(); ++i) {
+        char c = str[i];
+        if (static_cast<unsigned char>(c) >= 0x80) {
+            size_t len = utf8_length(str.substr(i));
+            if (len == 0) {
+                res += "\\ufffd";
+            } else {
+                res += str.substr(i, len);
+                i += len - 1;
+            }
+            continue;
+        }
+        switch (c) {
+            case '"': res += "\\\""; break;
+            case '\\': res += "\\\\"; break;
+            case '\n': res += "\\n"; break;
+            case '\t': res += "\\t"; break;
+            case '\r': res += "\\r"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    res += buf;
+                } else {
+                    res += c;
+                }
+        }
+    }
+    return res;
+}
+
+template<typename Set>
+std::vector<uint64_t> count_set_lines(Set& set, std::ifstream& input) {
+    std::vector<uint64_t> counts(set.size(), 0);
+    std::vector<unsigned> ids;
+    std::string line;
+    while (getline(input, line)) {
+        set.match(line, ids);
+        for (auto id : ids) {
+            ++counts[id];
+        }
+    }
+    return counts;
+}
+
+// reads the file once and counts the matching lines of every pattern
+void count_lines_set(std::string const& patterns_file, std::string file,
+        std::string const& format, bool prefilter) {
+    auto patterns = read_patterns(patterns_file);
+    if (format == "tsv") {
+        // a tab in a pattern would be read as the end of its column
+        for (auto const& pattern : patterns) {
+            if (pattern.find('\t') != pattern.npos) {
+                std::cerr << "A pattern contains a tab, which the tsv format can not print, "
+                          << "use --format json\n";
+                std::exit(1);
+            }
+        }
+    }
+    std::ifstream input(file);
+
+    if (!input.is_open()) {
+        std::cerr << "Failed to open file " << file << '\n';
+        std::exit(1);
+    }
+
+    std::vector<uint64_t> counts;
+    if (prefilter) {
+        CSA::FilteredSet set(patterns);
+        counts = count_set_lines(set, input);
+    } else {
+        CSA::PatternSet set(patterns);
+        counts = count_set_lines(set, input);
+    }
+
+    if (format == "json") {
+        std::cout << "[";
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            std::cout << (i ? ",\n " : "\n ") << "{\"pattern\": \"" << json_escape(patterns[i])
+                << "\", \"count\": " << counts[i] << "}";
+        }
+        std::cout << "\n]" << std::endl;
+    } else {
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            std::cout << patterns[i] << '\t' << counts[i] << '\n';
+        }
+        std::cout.flush();
+    }
+}
+
+void match_file(std::string_view pattern, std::string file, unsigned threads) {
+    std::ifstream input(file, std::ios::binary);
+
+    if (!input.is_open()) {
+        std::cerr << "Failed to open file " << file << '\n';
+        std::exit(1);
+    }
+
+    if (threads > 1) {
+        // the parallel matcher needs the whole record in memory
+        std::string text{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+        CSA::ParallelMatcher matcher(pattern, threads);
+        std::cout << (matcher.match(text) ? 1 : 0) << std::endl;
+        return;
+    }
+
+    CSA::Matcher matcher(pattern);
+    std::vector<char> buffer(1 << 16);
+    matcher.begin();
+    while (input) {
+        input.read(buffer.data(), buffer.size());
+        if (!matcher.feed(std::string_view(buffer.data(), input.gcount()))) {
+            break;
+        }
+    }
+
+    std::cout << (matcher.finish() ? 1 : 0) << std::endl;
+}
+
+void count_matches(std::string_view pattern, std::vector<std::string> const& files) {
+    CSA::Matcher matcher(pattern);
+    std::vector<char> buffer(1 << 16);
+    for (auto const& file : files) {
+        std::ifstream input(file, std::ios::binary);
+
+        if (!input.is_open()) {
+            std::cerr << "Failed to open file " << file << '\n';
+            std::exit(1);
+        }
+
+        auto stream = CSA::stream_matches(matcher.config());
+        uint64_t matches = 0;
+        while (input) {
+            input.read(buffer.data(), buffer.size());
+            stream.feed(std::string_view(buffer.data(), input.gcount()));
+            while (stream.next()) {
+                ++matches;
+            }
+        }
+        stream.close();
+        while (stream.next()) {
+            ++matches;
+        }
+
+        if (files.size() == 1) {
+            std::cout << matches << std::endl;
+        } else {
+            std::cout << file << ':' << matches << std::endl;
+        }
+    }
+}
+
+// serves until SIGINT or SIGTERM, the server removes its socket when it
+// is destroyed
+void serve(std::string const& socket_path, size_t memory_budget) {
+    // blocked before any thread is started, so only the waiter takes them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    CSA::Server server(socket_path, 1024, memory_budget);
+    // stop can not be called from a signal handler
+    std::thread waiter([&] {
+        int signal;
+        sigwait(&signals, &signal);
+        server.stop();
+    });
+    // also when run throws, destroying the joinable waiter would terminate
+    struct WaiterJoin {
+        std::thread& waiter;
+        ~WaiterJoin() {
+            // wakes the waiter if the server did not stop because of a signal
+            pthread_kill(waiter.native_handle(), SIGTERM);
+            waiter.join();
+        }
+    } join_waiter{waiter};
+    server.run();
+}
+
 void debug_ca(std::string_view pattern, bool print_graph) {
     auto ca = CA::glushkov::Builder::get_ca(pattern);
     if (print_graph) {
@@ -50,10 +301,52 @@ int main (int argc, char *argv[]) {
 
     argparse::ArgumentParser lines_command("lines");
     lines_command.add_description("Outputs the number of lines matching pattern");
-    lines_command.add_argument("pattern")
+    lines_command.add_argument("args")
+        .help("the pattern using the RE2 syntax and the file to be read, "
+              "only the file when --patterns is used")
+        .nargs(1, 2);
+    lines_command.add_argument("--patterns")
+        .help("file with one pattern per line, the input is read once "
+              "and one count per pattern is printed");
+    lines_command.add_argument("--format")
+        .help("output format used with --patterns: tsv or json, tsv can not print patterns with a tab")
+        .default_value("tsv"s);
+    lines_command.add_argument("--prefilter")
+        .help("use the literal prefilter instead of the combined automaton with --patterns")
+        .default_value(false)
+        .implicit_value(true);
+    lines_command.add_argument("--shared-cache")
+        .help("name of a shared memory segment where the processes counting the "
+              "same pattern share the computed states, without --patterns");
+
+    argparse::ArgumentParser match_command("match");
+    match_command.add_description("Outputs 1 if the whole file matches pattern as a single record, 0 otherwise");
+    match_command.add_argument("pattern")
         .help("regex using the RE2 syntax");
-    lines_command.add_argument("file")
+    match_command.add_argument("file")
         .help("the file to be read");
+    match_command.add_argument("--threads")
+        .help("split the record into chunks matched speculatively in parallel")
+        .default_value(1u)
+        .scan<'u', unsigned>();
+
+    argparse::ArgumentParser count_command("count");
+    count_command.add_description("Outputs the number of non-overlapping matches of pattern in each file");
+    count_command.add_argument("pattern")
+        .help("regex using the RE2 syntax");
+    count_command.add_argument("files")
+        .help("the files to be read")
+        .nargs(argparse::nargs_pattern::at_least_one);
+
+    argparse::ArgumentParser serve_command("serve");
+    serve_command.add_description("Serves match requests on a Unix socket, the compiled patterns stay resident");
+    serve_command.add_argument("--socket")
+        .help("path of the Unix domain socket")
+        .required();
+    serve_command.add_argument("--memory-budget")
+        .help("bytes of the state cache of each pattern before it is flushed, 0 for unlimited")
+        .default_value(size_t(0))
+        .scan<'u', size_t>();
 
     argparse::ArgumentParser debug_command("debug");
     debug_command.add_description("Prints the automaton in DOT format.");
@@ -67,6 +360,9 @@ int main (int argc, char *argv[]) {
         .implicit_value(true);
 
     program.add_subparser(lines_command);
+    program.add_subparser(match_command);
+    program.add_subparser(count_command);
+    program.add_subparser(serve_command);
     program.add_subparser(debug_command);
 
     try {
@@ -75,6 +371,12 @@ int main (int argc, char *argv[]) {
         std::cerr << err.what() << std::endl;
         if (program.is_subcommand_used(lines_command)) {
             std::cerr << lines_command;
+        } else if (program.is_subcommand_used(match_command)) {
+            std::cerr << match_command;
+        } else if (program.is_subcommand_used(count_command)) {
+            std::cerr << count_command;
+        } else if (program.is_subcommand_used(serve_command)) {
+            std::cerr << serve_command;
         } else if (program.is_subcommand_used(debug_command)) {
             std::cerr << debug_command;
         } else {
@@ -83,24 +385,55 @@ int main (int argc, char *argv[]) {
         std::exit(1);
     }
 
-    if (program.is_subcommand_used(lines_command)) {
-        auto pattern = lines_command.get<std::string>("pattern");
-        auto file_name = lines_command.get<std::string>("file");
-        count_lines(pattern, std::move(file_name));
-    } else if (program.is_subcommand_used(debug_command)) {
-        auto pattern = debug_command.get<std::string>("pattern");
-        auto automaton = debug_command.get<std::string>("automaton");
-        bool print = debug_command["--check"] == false;
-        if (automaton == "ca") {
-            debug_ca(pattern, print);
-        } else if (automaton == "csa") {
-            debug_csa(pattern, print);
+    try {
+        if (program.is_subcommand_used(lines_command)) {
+            auto args = lines_command.get<std::vector<std::string>>("args");
+            auto patterns_file = lines_command.present("--patterns");
+            if (patterns_file) {
+                auto format = lines_command.get<std::string>("--format");
+                if (args.size() != 1 || (format != "tsv" && format != "json")) {
+                    std::cerr << lines_command;
+                    std::exit(1);
+                }
+                count_lines_set(*patterns_file, std::move(args[0]), format,
+                        lines_command["--prefilter"] == true);
+            } else {
+                if (args.size() != 2) {
+                    std::cerr << lines_command;
+                    std::exit(1);
+                }
+                count_lines(args[0], std::move(args[1]), lines_command.present("--shared-cache"));
+            }
+        } else if (program.is_subcommand_used(match_command)) {
+            auto pattern = match_command.get<std::string>("pattern");
+            auto file_name = match_command.get<std::string>("file");
+            auto threads = match_command.get<unsigned>("--threads");
+            match_file(pattern, std::move(file_name), threads);
+        } else if (program.is_subcommand_used(count_command)) {
+            auto pattern = count_command.get<std::string>("pattern");
+            auto files = count_command.get<std::vector<std::string>>("files");
+            count_matches(pattern, files);
+        } else if (program.is_subcommand_used(serve_command)) {
+            serve(serve_command.get<std::string>("--socket"),
+                  serve_command.get<size_t>("--memory-budget"));
+        } else if (program.is_subcommand_used(debug_command)) {
+            auto pattern = debug_command.get<std::string>("pattern");
+            auto automaton = debug_command.get<std::string>("automaton");
+            bool print = debug_command["--check"] == false;
+            if (automaton == "ca") {
+                debug_ca(pattern, print);
+            } else if (automaton == "csa") {
+                debug_csa(pattern, print);
+            } else {
+                std::cerr << "automaton must be either ca or csa\n";
+                std::exit(1);
+            }
         } else {
-            std::cerr << "automaton must be either ca or csa\n";
-            std::exit(1);
+            std::cerr << program;
         }
-    } else {
-        std::cerr << program;
+    } catch (CSA::Error const& err) {
+        std::cerr << err.what() << std::endl;
+        return static_cast<int>(err.code());
     }
 
     return 0;
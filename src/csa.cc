@@ -2,7 +2,9 @@
 #include "ca.hh"
 #include "glushkov.hh"
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cstddef>
 #include <cstdint>
 #include <iterator>
@@ -19,16 +21,16 @@ using namespace std;
 using namespace std::string_literals;
 
 
-unsigned CountingSet::max_postponed(int max) const {
+CounterValue CountingSet::max_postponed(int max) const {
     assert(!list_.empty());
 
-    if (static_cast<int>(offset_ - list_.back() + 1) <= max || max == -1) {
+    if (max == -1 || offset_ - list_.back() + 1 <= static_cast<CounterValue>(max)) {
         return offset_ - list_.back() + 1;
     }
     return offset_ - *prev(list_.end(), 2) + 1;
 }
 
-unsigned CountingSet::min_postponed() const {
+CounterValue CountingSet::min_postponed() const {
     assert(!list_.empty());
 
     return offset_ - list_.front() + 1;
@@ -43,7 +45,8 @@ void CountingSet::merge(CountingSet &&other) {
         return;
     }
     if (other.offset_ - other.list_.back() > offset_ - list_.back()) {
-        list_.swap(other.list_);
+        // not list::swap, the sets can have different resources
+        std::swap(list_, other.list_);
         std::swap(offset_, other.offset_);
         return;
     }
@@ -65,7 +68,7 @@ void CountingSet::increment(int max) {
     assert(!list_.empty());
 
     offset_++;
-    if (static_cast<int>(offset_ - list_.back()) > max && max != -1) {
+    if (max != -1 && offset_ - list_.back() > static_cast<CounterValue>(max)) {
         list_.pop_back();
     }
 }
@@ -82,8 +85,60 @@ void CountingSet::insert_1() {
     }
 }
 
-vector<unsigned> CountingSet::to_vec() const {
-    vector<unsigned> vec;
+static void encode_varint(string& out, uint64_t val) {
+    while (val >= 0x80) {
+        out.push_back(static_cast<char>((val & 0x7F) | 0x80));
+        val >>= 7;
+    }
+    out.push_back(static_cast<char>(val));
+}
+
+static uint64_t decode_varint(string_view data, size_t& pos) {
+    uint64_t val = 0;
+    for (unsigned shift = 0; pos < data.size(); shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return val;
+        }
+    }
+    FATAL_ERROR("truncated varint", Errors::InternalFailure);
+}
+
+// the values are increasing along the list, so the first value is stored
+// followed by the differences
+void CountingSet::encode(string& out) const {
+    encode_varint(out, list_.size());
+    CounterValue prev = 0;
+    for (auto i : list_) {
+        encode_varint(out, (offset_ - i) - prev);
+        prev = offset_ - i;
+    }
+}
+
+size_t CountingSet::decode(string_view data) {
+    size_t pos = 0;
+    auto size = decode_varint(data, pos);
+    list_.clear();
+    if (size == 0) {
+        offset_ = 1;
+        return pos;
+    }
+    CounterValue val = 0;
+    for (uint64_t i = 0; i < size; ++i) {
+        val += decode_varint(data, pos);
+        list_.push_back(val);
+    }
+    // the largest value has the offset as the stored element
+    offset_ = val;
+    for (auto& i : list_) {
+        i = offset_ - i;
+    }
+    return pos;
+}
+
+vector<CounterValue> CountingSet::to_vec() const {
+    vector<CounterValue> vec;
     vec.reserve(list_.size());
     for (auto i : list_) {
         vec.push_back(offset_ - i);
@@ -91,9 +146,26 @@ vector<unsigned> CountingSet::to_vec() const {
     return vec;
 }
 
+NormalStateVec StateSet::to_vec() const {
+    if (!dense()) {
+        return NormalStateVec(sparse_.begin(), sparse_.end());
+    }
+    size_t count = 0;
+    for (auto word : bits_) {
+        count += std::popcount(word);
+    }
+    auto vec = NormalStateVec::with_reserved(count);
+    for (size_t i = 0; i < bits_.size(); ++i) {
+        for (uint64_t word = bits_[i]; word; word &= word - 1) {
+            vec.push_back(CA::StateId(i * 64 + std::countr_zero(word)));
+        }
+    }
+    return vec;
+}
+
 void LValueTable::add_lval(CA::StateId state, LValueEnum type, LValueRowIndex index) {
-    std::vector<LValue> &row = tab_[index];
-    std::vector<LValue>::iterator it = find(row.begin(), row.end(), LValue(state, type));
+    LValueRow &row = tab_[index];
+    auto it = find(row.begin(), row.end(), LValue(state, type));
     if (it == row.end()) {
         row.push_back(LValue(state, type));
     } else if (it->type() != type) {
@@ -118,39 +190,38 @@ OrdVector<OrdVector<CA::StateId>> CountersToReset::get_cnt_set_names() {
     return names;
 }
 
-void Update::optimize(size_t new_size) {
+// drops the moves that only rename the sets, returns the type of the update
+static UpdateEnum optimize_update(UpdateProg& prog, size_t new_size) {
     if (new_size == 0) {
-        type_ = UpdateEnum::Out;
-        return;
+        return UpdateEnum::Out;
     }
     std::vector<bool> moved_to(new_size, false);
     // checks if all moves are only renames
-    for (auto &inst : prog_) {
+    for (auto &inst : prog) {
         if (inst.type() == CntSetInstEnum::Move) {
             moved_to[inst.target()] = true;
             if (inst.target() != inst.origin()) {
-                type_ = UpdateEnum::NewSets;
-                return;
+                return UpdateEnum::NewSets;
             }
         }
     }
-    vector<CntSetInst> new_prog;
-    for (auto &inst: prog_) {
+    UpdateProg new_prog(prog.get_allocator());
+    for (auto &inst: prog) {
         if (inst.type() == CntSetInstEnum::Insert_1 && !moved_to[inst.target()]) {
             new_prog.emplace_back(CntSetInstEnum::Rst_to_1, inst.origin(), inst.target());
         } else if (inst.type() != CntSetInstEnum::Move) {
             new_prog.push_back(inst);
         }
     }
-    prog_ = std::move(new_prog);
-    if (prog_.empty()) {
-        type_ = UpdateEnum::Noop;
+    prog = std::move(new_prog);
+    if (prog.empty()) {
+        return UpdateEnum::Noop;
     } else {
-        type_ = UpdateEnum::KeepSets;
+        return UpdateEnum::KeepSets;
     }
 }
 
-OrdVector<OrdVector<CA::StateId>> TransBuilder::compute_state_idexes(CSA& csa, Update& update) {
+OrdVector<OrdVector<CA::StateId>> TransBuilder::compute_state_idexes(CSA& csa, UpdateProg& prog) {
     OrdVector<OrdVector<CA::StateId>> state_indexes{};
     for (unsigned i = 0; i < lvals_.size(); ++i) {
         auto & row = lvals_[i];
@@ -167,7 +238,7 @@ OrdVector<OrdVector<CA::StateId>> TransBuilder::compute_state_idexes(CSA& csa, U
         }
         if (all_plus) {
             auto max = csa.ca().get_counter(csa.ca().get_state(row[0].state()).cnt()).max();
-            update.add_inst(CntSetInstEnum::Incr, i, max);
+            prog.emplace_back(CntSetInstEnum::Incr, i, max);
             for (auto &lval : row) {
                 lval.set_type(LValueEnum::ID);
             }
@@ -177,10 +248,10 @@ OrdVector<OrdVector<CA::StateId>> TransBuilder::compute_state_idexes(CSA& csa, U
     return state_indexes;
 }
 
-Update TransBuilder::compute_update(CSA& csa) {
+Update const* TransBuilder::compute_update(CSA& csa) {
     LOG_BUILDER(to_str());
-    Update update;
-    auto state_indexes = compute_state_idexes(csa, update);
+    UpdateProg prog(lvals_.resource());
+    auto state_indexes = compute_state_idexes(csa, prog);
     auto rst_cnt_names = cnts_to_reset_.get_cnt_set_names();
     for (auto& name: rst_cnt_names) {
         state_indexes.insert(std::move(name));
@@ -193,31 +264,31 @@ Update TransBuilder::compute_update(CSA& csa) {
         OrdVector<CA::StateId> states;
         for (auto lval : row) { states.insert(lval.state()); }
         unsigned index = state_indexes.get_index(states);
-        update.add_inst(CntSetInstEnum::Move, i, index);
+        prog.emplace_back(CntSetInstEnum::Move, i, index);
         for (auto lval : row) {
             if (lval.type() == LValueEnum::ID) {
-                counter_.find(CounterState(lval.state()))->actual().insert(index);
+                counter_.at(lval.state()).actual().insert(index);
             } else {
-                counter_.find(CounterState(lval.state()))->postponed().insert(index);
+                counter_.at(lval.state()).postponed().insert(index);
             }
         }
     }
     for (auto& name: rst_cnt_names) {
         unsigned index = state_indexes.get_index(name);
-        update.add_inst(CntSetInstEnum::Insert_1, index, index);
+        prog.emplace_back(CntSetInstEnum::Insert_1, index, index);
         for (auto state : name) {
-            counter_.find(CounterState(state))->actual().insert(index);
+            counter_.at(state).actual().insert(index);
         }
     }
-    update.optimize(state_indexes.size());
-    State state(std::move(normal_), std::move(counter_), state_indexes.size());
-    update.set_next_state(csa.get_state(std::move(state)));
-    return update;
+    auto type = optimize_update(prog, state_indexes.size());
+    State state(normal_.to_vec(), std::move(counter_), state_indexes.size());
+    return csa.get_update(type, csa.get_state(std::move(state)), prog);
 }
 
-GuardedTransBuilder::GuardedTransBuilder(CA::CA<uint8_t> const& ca,
-        State const& state, uint8_t symbol) : TransBuilder(state.cnt_sets()),
-        guards_(), guarded_states_(), guarded_lvals_(), guarded_resets_() {
+GuardedTransBuilder::GuardedTransBuilder(CA::CA<uint8_t> const& ca, State const& state,
+        uint8_t symbol, std::pmr::memory_resource* resource)
+        : TransBuilder(ca.state_count(), state.cnt_sets(), resource),
+        guards_(), guarded_states_(resource), guarded_lvals_(resource), guarded_resets_(resource) {
     for (auto const& ca_state : state.normal()) {
         auto& ca_transitions = ca.get_state(ca_state).transitions();
         for (auto& ca_trans : ca_transitions) {
@@ -226,7 +297,7 @@ GuardedTransBuilder::GuardedTransBuilder(CA::CA<uint8_t> const& ca,
             }
             auto target = ca_trans.target();
             if (ca_trans.op() == CA::Operator::Rst) {
-                counter_.insert(CounterState(target));
+                counter_.insert(target);
                 cnts_to_reset_.add_state(target, ca.get_state(target).cnt());
             } else {
                 normal_.insert(target);
@@ -282,18 +353,18 @@ void GuardedTransBuilder::add_cnt_state(CA::CA<uint8_t> const& ca,
         } else {
             switch(ca_trans.op()) {
                 case CA::Operator::Incr:
-                    counter_.insert(CounterState(target));
+                    counter_.insert(target);
                     for (auto index : cnt_state.actual()) {
                         lvals_.add_lval(target, LValueEnum::Plus, index);
                     }
                     assert(cnt_state.postponed().empty());
                     break;
                 case CA::Operator::Rst:
-                    counter_.insert(CounterState(target));
+                    counter_.insert(target);
                     cnts_to_reset_.add_state(target, ca.get_state(target).cnt());
                     break;
                 case CA::Operator::ID:
-                    counter_.insert(CounterState(target));
+                    counter_.insert(target);
                     for (auto index : cnt_state.actual()) {
                         lvals_.add_lval(target, LValueEnum::ID, index);
                     }
@@ -319,7 +390,7 @@ TransEnum GuardedTransBuilder::trans_type() const {
     }
 }
 
-Update GuardedTransBuilder::create_update(std::vector<bool> const& sat_guards, CSA& csa) {
+Update const* GuardedTransBuilder::create_update(std::vector<bool> const& sat_guards, CSA& csa) {
     // creating copy because the computation destroys the builder
     TransBuilder builder(normal_, counter_, lvals_, cnts_to_reset_);
     prepare_builder(sat_guards, builder);
@@ -364,8 +435,8 @@ SmallTrans* GuardedTransBuilder::small(CSA& csa) {
     return trans;
 }
 
-Update* GuardedTransBuilder::no_condition(CSA& csa) {
-    return new Update(compute_update(csa));
+Update const* GuardedTransBuilder::no_condition(CSA& csa) {
+    return compute_update(csa);
 }
 
 void GuardedTransBuilder::prepare_builder(std::vector<bool> const& sat_guards,
@@ -385,85 +456,454 @@ void GuardedTransBuilder::prepare_builder(std::vector<bool> const& sat_guards,
     }
 }
 
-Update const& LazyTrans::update(unsigned index, vector<bool> const& sat_guards, CSA& csa) {
-    auto it = cache_.find(index);
-    if (it != cache_.end()) {
-        return it->second;
-    } else {
-        it = cache_.insert(it, make_pair(index, builder_.create_update(sat_guards, csa)));
-        return it->second;
+LazyTrans::~LazyTrans() {
+    for (auto& bucket : buckets_) {
+        Node* node = bucket.load(std::memory_order_relaxed);
+        while (node) {
+            Node* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+}
+
+Update const* LazyTrans::find(uint64_t index) const {
+    auto const& bucket = buckets_[index % bucket_count];
+    for (Node* node = bucket.load(std::memory_order_acquire); node; node = node->next) {
+        if (node->index == index) {
+            return node->update;
+        }
     }
+    return nullptr;
+}
+
+void LazyTrans::add(uint64_t index, Update const* update) {
+    if (find(index)) {
+        return;
+    }
+    auto& bucket = buckets_[index % bucket_count];
+    Node* node = new Node{index, update, bucket.load(std::memory_order_relaxed)};
+    bucket.store(node, std::memory_order_release);
+}
+
+size_t LazyTrans::memory() const {
+    size_t mem = sizeof(LazyTrans) + guards().size() * sizeof(Guard);
+    for_each([&](uint64_t, Update const&) { mem += sizeof(Node); });
+    return mem;
+}
+
+Update const& LazyTrans::update(uint64_t index, CSA& csa) {
+    if (auto update = find(index)) {
+        return *update;
+    }
+    auto lock = csa.lock();
+    // another thread could have added it before the lock was taken
+    if (auto update = find(index)) {
+        return *update;
+    }
+    vector<bool> sat_guards(guards().size());
+    for (size_t i = 0; i < sat_guards.size(); ++i) {
+        sat_guards[i] = (index >> i) & 1;
+    }
+    auto& bucket = buckets_[index % bucket_count];
+    Node* node = new Node{index, builder_.create_update(sat_guards, csa),
+        bucket.load(std::memory_order_relaxed)};
+    bucket.store(node, std::memory_order_release);
+    csa.charge(sizeof(Node));
+    return *node->update;
 }
 
 Trans::~Trans() {
-    switch (type_) {
-        case TransEnum::NoCondition:
-            delete update_;
-            break;
+    switch (type()) {
         case TransEnum::Small:
-            delete small_;
+            delete small();
             break;
         case TransEnum::Lazy:
-            delete lazy_;
+            delete lazy();
             break;
         default:
             break;
     }
 }
 
-CachedState* CSA::get_state(State state) {
-    auto it = states_.find(state);
-    if (it != states_.end()) {
-        return &(*it);
-    } else {
-        it = states_.insert(it, make_pair(state, vector<Trans>(ca_.bytemap_range())));
-        return &(*it);
+StateCache::StateCache(unsigned bytemap_range, shared_ptr<pmr::memory_resource> resource)
+    : resource_(std::move(resource)), alloc_(resource_.get()), chunks_(resource_.get()),
+    blobs_(resource_.get(), blob_block_words), index_(resource_.get()), key_(resource_.get()),
+    updates_(resource_.get()), bytemap_range_(bytemap_range), size_(0), configs_(0) {}
+
+StateCache::~StateCache() {
+    for (auto& chunk : chunks_) {
+        free_transitions(chunk);
+        alloc_.deallocate_object(chunk.states, chunk.count);
+    }
+}
+
+void StateCache::encode(State const& state, pmr::vector<uint32_t>& out) {
+    out.clear();
+    out.push_back(state.normal().size());
+    out.insert(out.end(), state.normal().begin(), state.normal().end());
+    out.push_back(state.counter().size());
+    uint32_t offset = out.size() + 4 * state.counter().size();
+    for (auto const& cnt_state : state.counter()) {
+        out.push_back(cnt_state.state());
+        out.push_back(offset);
+        out.push_back(cnt_state.actual().size());
+        out.push_back(cnt_state.postponed().size());
+        offset += cnt_state.actual().size() + cnt_state.postponed().size();
+    }
+    for (auto const& cnt_state : state.counter()) {
+        out.insert(out.end(), cnt_state.actual().begin(), cnt_state.actual().end());
+        out.insert(out.end(), cnt_state.postponed().begin(), cnt_state.postponed().end());
+    }
+}
+
+void StateCache::free_transitions(Chunk& chunk) {
+    if (chunk.trans) {
+        std::destroy_n(chunk.trans, chunk.count * bytemap_range_);
+        alloc_.deallocate_object(chunk.trans, chunk.count * bytemap_range_);
+        chunk.trans = nullptr;
+    }
+}
+
+CachedState* StateCache::at(StateIndex id) {
+    // chunk c holds the ids [2^(c+4) - 16, 2^(c+5) - 16)
+    size_t pos = static_cast<size_t>(id) + (1 << first_chunk_bits);
+    size_t chunk = std::bit_width(pos) - 1 - first_chunk_bits;
+    return &chunks_[chunk].states[pos - (size_t(1) << (chunk + first_chunk_bits))];
+}
+
+void StateCache::grow_index() {
+    decltype(index_) old(std::max(first_index_size, 2 * index_.size()), Slot{0, empty_slot},
+            index_.get_allocator());
+    old.swap(index_);
+    size_t mask = index_.size() - 1;
+    for (auto const& slot : old) {
+        if (slot.id == empty_slot) {
+            continue;
+        }
+        size_t pos = slot.hash & mask;
+        while (index_[pos].id != empty_slot) {
+            pos = (pos + 1) & mask;
+        }
+        index_[pos] = slot;
+    }
+}
+
+CachedState* StateCache::get(State const& state, bool& added) {
+    // at most half full
+    if (2 * (size_ + 1) > index_.size()) {
+        grow_index();
+    }
+    encode(state, key_);
+    uint64_t hash = state.hash();
+    size_t mask = index_.size() - 1;
+    size_t pos = hash & mask;
+    for (; index_[pos].id != empty_slot; pos = (pos + 1) & mask) {
+        if (index_[pos].hash != hash) {
+            continue;
+        }
+        CachedState* cached = at(index_[pos].id);
+        if (cached->size_ == key_.size() && std::equal(key_.begin(), key_.end(), cached->blob_)) {
+            added = false;
+            return cached;
+        }
+    }
+    added = true;
+    StateIndex id = size_++;
+    size_t chunk_pos = static_cast<size_t>(id) + (1 << first_chunk_bits);
+    size_t chunk = std::bit_width(chunk_pos) - 1 - first_chunk_bits;
+    if (chunk == chunks_.size()) {
+        size_t count = size_t(1) << (chunk + first_chunk_bits);
+        auto* states = alloc_.allocate_object<CachedState>(count);
+        std::uninitialized_default_construct_n(states, count);
+        auto* trans = alloc_.allocate_object<Trans>(count * bytemap_range_);
+        std::uninitialized_default_construct_n(trans, count * bytemap_range_);
+        chunks_.push_back(Chunk{states, trans, count});
+    }
+    size_t offset = chunk_pos - (size_t(1) << (chunk + first_chunk_bits));
+    uint32_t* blob = blobs_.alloc(key_.size());
+    std::copy(key_.begin(), key_.end(), blob);
+
+    CachedState& cached = chunks_[chunk].states[offset];
+    cached.blob_ = blob;
+    cached.trans_ = chunks_[chunk].trans + offset * bytemap_range_;
+    cached.size_ = key_.size();
+    cached.id_ = id;
+    cached.cnt_sets_ = state.cnt_sets();
+    index_[pos] = Slot{hash, id};
+    return &cached;
+}
+
+void StateCache::clear_transitions() {
+    for (auto& chunk : chunks_) {
+        free_transitions(chunk);
+    }
+    for (StateIndex id = 0; id < size_; ++id) {
+        at(id)->trans_ = nullptr;
+    }
+    updates_.clear();
+}
+
+static uint64_t hash_update(UpdateEnum type, CachedState* next_state, UpdateProg const& prog) {
+    uint64_t seed = hash_mix(static_cast<uint64_t>(type), reinterpret_cast<uintptr_t>(next_state));
+    for (auto const& inst : prog) {
+        seed = hash_mix(seed, static_cast<uint64_t>(inst.type()));
+        seed = hash_mix(seed, (static_cast<uint64_t>(inst.origin()) << 32) | inst.target());
+    }
+    return hash_finish(seed);
+}
+
+void UpdatePool::grow_index() {
+    decltype(index_) old(std::max(first_index_size, 2 * index_.size()), {0, nullptr},
+            index_.get_allocator());
+    old.swap(index_);
+    size_t mask = index_.size() - 1;
+    for (auto const& slot : old) {
+        if (!slot.second) {
+            continue;
+        }
+        size_t pos = slot.first & mask;
+        while (index_[pos].second) {
+            pos = (pos + 1) & mask;
+        }
+        index_[pos] = slot;
+    }
+}
+
+Update const* UpdatePool::get(UpdateEnum type, CachedState* next_state, UpdateProg const& prog,
+        bool& added) {
+    // at most half full
+    if (2 * (size_ + 1) > index_.size()) {
+        grow_index();
+    }
+    uint64_t hash = hash_update(type, next_state, prog);
+    size_t mask = index_.size() - 1;
+    size_t pos = hash & mask;
+    for (; index_[pos].second; pos = (pos + 1) & mask) {
+        Update const* update = index_[pos].second;
+        if (index_[pos].first == hash && update->type() == type
+                && update->next_state() == next_state
+                && std::ranges::equal(update->prog(), prog)) {
+            added = false;
+            return update;
+        }
+    }
+    added = true;
+    CntSetInst* arena = progs_.alloc(prog.size());
+    std::uninitialized_copy(prog.begin(), prog.end(), arena);
+    Update const* update = &updates_.emplace_back(type, next_state, arena, prog.size());
+    index_[pos] = {hash, update};
+    ++size_;
+    return update;
+}
+
+void UpdatePool::clear() {
+    updates_.clear();
+    progs_.clear();
+    index_.clear();
+    size_ = 0;
+}
+
+CounterStateView CachedState::counter(CA::StateId state) const {
+    uint32_t const* first = blob_ + blob_[0] + 2;
+    uint32_t count = counter_count();
+    // the records are sorted by the state
+    uint32_t lo = 0;
+    uint32_t hi = count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (first[4 * mid] < state) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    assert(lo < count && first[4 * lo] == state);
+    return CounterStateView(blob_, first + 4 * lo);
+}
+
+State CachedState::state() const {
+    NormalStateVec normal;
+    for (auto ca_state : this->normal()) {
+        normal.push_back(ca_state);
+    }
+    CounterStateMap counter;
+    for (uint32_t i = 0; i < counter_count(); ++i) {
+        auto view = counter_at(i);
+        auto& cnt_state = counter.push_back(view.state());
+        for (auto index : view.actual()) {
+            cnt_state.actual().insert(index);
+        }
+        for (auto index : view.postponed()) {
+            cnt_state.postponed().insert(index);
+        }
+    }
+    return State(std::move(normal), std::move(counter), cnt_sets_);
+}
+
+CachedState* CSA::get_state(State const& state) {
+    auto lock = this->lock();
+    bool added;
+    auto* cached = states_->get(state, added);
+    if (added) {
+        // the state, its key in the index and its transitions
+        charge(sizeof(CachedState) + cached->words() * sizeof(uint32_t) + 4 * sizeof(void*)
+                + ca_.bytemap_range() * sizeof(Trans));
+    }
+    return cached;
+}
+
+Update const* CSA::get_update(UpdateEnum type, CachedState* next_state, UpdateProg const& prog) {
+    auto lock = this->lock();
+    bool added;
+    auto* update = states_->updates().get(type, next_state, prog, added);
+    if (added) {
+        // the update, its program and its slot in the index
+        charge(update->memory() + 4 * sizeof(void*));
+    }
+    return update;
+}
+
+void CSA::flush() {
+    // the old cache stays alive while configs and flows use it
+    states_ = std::make_shared<StateCache>(ca_.bytemap_range(), cache_resource_);
+    memory_ = 0;
+    ++flushes_;
+}
+
+size_t Trans::memory() const {
+    // the updates are charged when they are added to the pool
+    switch (type()) {
+        case TransEnum::Small:
+            return sizeof(SmallTrans) + small()->guards().size() * sizeof(Guard)
+                + small()->updates().size() * sizeof(Update const*);
+        case TransEnum::Lazy:
+            return lazy()->memory();
+        default:
+            return 0;
+    }
+}
+
+RecyclingResource::~RecyclingResource() {
+    for (size_t i = 0; i < size_classes; ++i) {
+        while (free_[i]) {
+            Block* next = free_[i]->next;
+            upstream_->deallocate(free_[i], (i + 1) * granularity, granularity);
+            free_[i] = next;
+        }
+    }
+}
+
+void* RecyclingResource::do_allocate(size_t bytes, size_t alignment) {
+    size_t cls = size_class(bytes, alignment);
+    if (cls == 0 || cls > size_classes) {
+        return upstream_->allocate(bytes, alignment);
+    }
+    if (Block* block = free_[cls - 1]) {
+        free_[cls - 1] = block->next;
+        return block;
+    }
+    // the whole class size, so that the block can serve any size of it
+    return upstream_->allocate(cls * granularity, granularity);
+}
+
+void RecyclingResource::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    size_t cls = size_class(bytes, alignment);
+    if (cls == 0 || cls > size_classes) {
+        upstream_->deallocate(p, bytes, alignment);
+        return;
+    }
+    auto* block = static_cast<Block*>(p);
+    block->next = free_[cls - 1];
+    free_[cls - 1] = block;
+}
+
+ScratchResource::~ScratchResource() {
+    for (auto const& block : blocks_) {
+        upstream_->deallocate(block.data, block.size, block.alignment);
+    }
+}
+
+void* ScratchResource::do_allocate(size_t bytes, size_t alignment) {
+    for (; block_ < blocks_.size(); ++block_, used_ = 0) {
+        void* p = blocks_[block_].data + used_;
+        size_t space = blocks_[block_].size - used_;
+        if (std::align(alignment, bytes, p, space)) {
+            used_ = blocks_[block_].size - space + bytes;
+            return p;
+        }
     }
+    size_t size = blocks_.empty() ? first_block_size : 2 * blocks_.back().size;
+    while (size < bytes) {
+        size *= 2;
+    }
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    blocks_.push_back(Block{static_cast<std::byte*>(upstream_->allocate(size, alignment)),
+            size, alignment});
+    used_ = bytes;
+    return blocks_.back().data;
 }
 
 bool Config::step(uint8_t c) {
-    LOG_CONFIG(cur_state_->first.to_str(), cnt_sets_to_str());
+    LOG_CONFIG(cur_state_->to_str(), cnt_sets_to_str());
     LOG_CONFIG_SYMBOL(((c >= '!' && c <= '~') ? ("\""s + string(1, c) + "\""s) : to_string(c)), to_string(csa_.ca().get_byte_class(c)));
     uint8_t byte_class = csa_.ca().get_byte_class(c);
-    Trans& trans = cur_state_->second[byte_class];
-    if (trans.type() == TransEnum::NotComputed) {
-        compute_trans(trans, byte_class);
+    Trans* trans = &cur_state_->trans(byte_class);
+    auto type = trans->type();
+    if (type == TransEnum::NotComputed) {
+        auto lock = csa_.lock();
+        sync_cache();
+        if (csa_.over_budget()) {
+            flush_cache();
+        }
+        // the transition could have been computed by another config
+        trans = &cur_state_->trans(byte_class);
+        if (trans->type() == TransEnum::NotComputed) {
+            compute_trans(*trans, byte_class);
+        }
+        type = trans->type();
     }
-    switch(trans.type()) {
+    switch(type) {
         case TransEnum::WithoutCntState:
-            cur_state_ = trans.next_state();
+            cur_state_ = trans->next_state();
             break;
         case TransEnum::EnteringCntState:
-            cur_state_ = trans.next_state();
-            cnt_sets_.resize(cur_state_->first.cnt_sets(), CountingSet(1));
+            cur_state_ = trans->next_state();
+            cnt_sets_.resize(cur_state_->cnt_sets(), CountingSet(1, &cnt_resource_));
             break;
         case TransEnum::NoCondition:
-            execute_update(*trans.update());
+            execute_update(*trans->update());
             break;
         case TransEnum::Small:
-            execute_update(trans.small()->update(
-                compute_update_index(trans.small()->guards())));
+            execute_update(trans->small()->update(
+                compute_update_index(trans->small()->guards())));
             break;
         case TransEnum::Lazy:
-            execute_update(get_lazy_update(*trans.lazy()));
+            execute_update(get_lazy_update(*trans->lazy(), byte_class));
             break;
         default:
             FATAL_ERROR("unexpected type of transition", Errors::InternalFailure);
     }
-    if (cur_state_->first.normal().empty() && cur_state_->first.counter().empty()) {
+    if (cur_state_->dead()) {
         return false;
     }
     return true;
 }
 
-bool Config::accepting() {
-    for (auto state : cur_state_->first.normal()) {
-        if (csa_.ca().get_state(state).final() == CA::Guard::True) {
+bool Config::accepting(bool text_end) {
+    for (auto state : cur_state_->normal()) {
+        auto const& ca_state = csa_.ca().get_state(state);
+        if (ca_state.final() == CA::Guard::True && (text_end || !ca_state.end_only())) {
             return true;
         }
     }
-    for (auto& state : cur_state_->first.counter()) {
-        auto guard = csa_.ca().get_state(state.state()).final();
+    for (uint32_t i = 0; i < cur_state_->counter_count(); ++i) {
+        auto state = cur_state_->counter_at(i);
+        auto const& ca_state = csa_.ca().get_state(state.state());
+        if (!text_end && ca_state.end_only()) {
+            continue;
+        }
+        auto guard = ca_state.final();
         if (guard == CA::Guard::True) {
             return true;
         } else if (guard == CA::Guard::CanExit) {
@@ -475,13 +915,29 @@ bool Config::accepting() {
     return false;
 }
 
-bool Config::eval_guard(CA::Guard guard, CounterState const& cnt_state) {
+void Config::accepting_states(vector<CA::StateId>& states) {
+    for (auto state : cur_state_->normal()) {
+        if (csa_.ca().get_state(state).final() == CA::Guard::True) {
+            states.push_back(state);
+        }
+    }
+    for (uint32_t i = 0; i < cur_state_->counter_count(); ++i) {
+        auto state = cur_state_->counter_at(i);
+        auto guard = csa_.ca().get_state(state.state()).final();
+        if (guard == CA::Guard::True
+                || (guard == CA::Guard::CanExit && eval_guard(guard, state))) {
+            states.push_back(state.state());
+        }
+    }
+}
+
+bool Config::eval_guard(CA::Guard guard, CounterStateView cnt_state) {
     LOG_EVAL_GUARD(CA::guard_to_string(guard), cnt_state.to_str());
     if (guard == CA::Guard::CanIncr) {
         auto max = csa_.ca().get_counter(csa_.ca().get_state(cnt_state.state()).cnt()).max();
         LOG_EVAL_GUARD_MAX(max);
         for (auto i : cnt_state.actual()) {
-            if (cnt_sets_[i].min() < static_cast<unsigned>(max)) {
+            if (cnt_sets_[i].min() < static_cast<CounterValue>(max)) {
                 LOG_EVAL_GUARD_RES("true");
                 return true;
             }
@@ -495,7 +951,7 @@ bool Config::eval_guard(CA::Guard guard, CounterState const& cnt_state) {
         auto min = csa_.ca().get_counter(csa_.ca().get_state(cnt_state.state()).cnt()).min();
         LOG_EVAL_GUARD_MIN(min);
         for (auto i : cnt_state.actual()) {
-            if (cnt_sets_[i].max() >= static_cast<unsigned>(min)) {
+            if (cnt_sets_[i].max() >= static_cast<CounterValue>(min)) {
                 LOG_EVAL_GUARD_RES("true");
                 return true;
             }
@@ -517,7 +973,7 @@ void Config::execute_update(Update const& update) {
             cnt_sets_.resize(0);
             break;
         case UpdateEnum::KeepSets:
-            cnt_sets_.resize(update.next_state()->first.cnt_sets());
+            cnt_sets_.resize(update.next_state()->cnt_sets());
             for (auto const& inst : update.prog()) {
                 switch (inst.type()) {
                     case CntSetInstEnum::Rst_to_1:
@@ -535,7 +991,7 @@ void Config::execute_update(Update const& update) {
             }
             break;
         case UpdateEnum::NewSets:
-            cnt_sets_tmp_.resize(update.next_state()->first.cnt_sets());
+            cnt_sets_tmp_.resize(update.next_state()->cnt_sets());
             for (auto const& inst : update.prog()) {
                 switch (inst.type()) {
                     case CntSetInstEnum::Rst_to_1:
@@ -561,20 +1017,21 @@ uint64_t Config::compute_update_index(GuardVec const& guards) {
     uint64_t index = 0;
     for (unsigned i = 0; i < guards.size(); i++) {
         if (eval_guard(guards[i].condition,
-                       *cur_state_->first.counter().find(
-                           CounterState(guards[i].state)))) {
-            index |= (1 << i);
+                       cur_state_->counter(guards[i].state))) {
+            index |= uint64_t(1) << i;
         }
     }
     return index;
 }
 
 void Config::compute_trans(Trans& trans, uint8_t byte_class) {
-    if (cur_state_->first.counter().empty()) {
-        NormalStateVec normal;
-        CounterStateVec counter;
+    // the builders of the previous transitions are gone
+    builder_resource_.reset();
+    if (cur_state_->counter_count() == 0) {
+        StateSet normal(csa_.ca().state_count(), &builder_resource_);
+        CounterStateMap counter;
         CountersToReset reset;
-        for (auto ca_state : cur_state_->first.normal()) {
+        for (auto ca_state : cur_state_->normal()) {
             auto& ca_transitions = csa_.ca().get_state(ca_state).transitions();
             for (auto& ca_trans : ca_transitions) {
                 if (ca_trans.symbol() != byte_class 
@@ -585,28 +1042,28 @@ void Config::compute_trans(Trans& trans, uint8_t byte_class) {
                     normal.insert(ca_trans.target());
                 } else {
                     assert(ca_trans.op() == CA::Operator::Rst);
-                    counter.insert(CounterState(ca_trans.target()));
+                    counter.insert(ca_trans.target());
                     reset.add_state(ca_trans.target(), 
                             csa_.ca().get_state(ca_trans.target()).cnt());
                 }
             }
         }
         if (counter.empty()) {
-            State state(std::move(normal), std::move(counter), 0);
+            State state(normal.to_vec(), std::move(counter), 0);
             trans.set_next_state(csa_.get_state(std::move(state)), TransEnum::WithoutCntState);
         } else {
             auto names = reset.get_cnt_set_names();
             auto it = names.begin();
             for (unsigned i = 0; i < names.size(); ++i, ++it) {
                 for (auto state : *it) {
-                    counter.find(CounterState(state))->actual().insert(i);
+                    counter.at(state).actual().insert(i);
                 }
             }
-            State state(std::move(normal), std::move(counter), names.size());
+            State state(normal.to_vec(), std::move(counter), names.size());
             trans.set_next_state(csa_.get_state(std::move(state)), TransEnum::EnteringCntState);
         }
     } else {
-        GuardedTransBuilder builder(csa_.ca(), cur_state_->first, byte_class);
+        GuardedTransBuilder builder(csa_.ca(), cur_state_->state(), byte_class, &builder_resource_);
         switch (builder.trans_type()) {
             case TransEnum::NoCondition:
                 trans.set_update(builder.no_condition(csa_));
@@ -615,43 +1072,270 @@ void Config::compute_trans(Trans& trans, uint8_t byte_class) {
                 trans.set_small(builder.small(csa_));
                 break;
             case TransEnum::Lazy:
-                trans.set_lazy(new LazyTrans(std::move(builder)));
+                trans.set_lazy(new LazyTrans(builder));
                 break;
             default:
                 FATAL_ERROR("unexpected trans type of builder", Errors::InternalFailure);
         }
+        csa_.charge(trans.memory());
     }
 }
 
-Update const& Config::get_lazy_update(LazyTrans& lazy) {
-    auto const& guards = lazy.guards();
-    vector<bool> sat_guards(guards.size(), false);
-    uint64_t index = 0;
-    for (unsigned i = 0; i < guards.size(); i++) {
-        if (eval_guard(guards[i].condition,
-                       *cur_state_->first.counter().find(
-                           CounterState(guards[i].state)))) {
-            index |= (1 << i);
-            sat_guards[i] = true;
+Config::Config(CSA& csa)
+    : csa_(csa), cache_(), cur_state_(nullptr), init_state_(nullptr), restart_state_(nullptr),
+    cnt_resource_(csa.resource()), cnt_sets_(&cnt_resource_), cnt_sets_tmp_(&cnt_resource_),
+    builder_resource_(csa.resource()) {
+    // attached before the states are resolved, so that a flush by another
+    // config can not free the cache under them
+    auto lock = csa_.lock();
+    attach_cache();
+    cur_state_ = init_state_;
+}
+
+Config::~Config() {
+    auto lock = csa_.lock();
+    detach_cache();
+}
+
+void Config::attach_cache() {
+    cache_ = csa_.states_;
+    cache_->attach();
+    init_state_ = csa_.get_state(InitialState);
+    restart_state_ = csa_.get_state(restart_state(csa_.ca()));
+}
+
+void Config::detach_cache() {
+    // the flows saved in a flushed cache need only its states to be moved
+    // to the new one
+    if (cache_->detach() && cache_ != csa_.states_) {
+        cache_->clear_transitions();
+    }
+    cache_.reset();
+}
+
+void Config::sync_cache() {
+    if (cache_ == csa_.states_) {
+        return;
+    }
+    State state = cur_state_->state();
+    detach_cache();
+    attach_cache();
+    cur_state_ = csa_.get_state(state);
+}
+
+void Config::flush_cache() {
+    csa_.flush();
+    sync_cache();
+}
+
+void Config::load(State const& state, CntSetVec const& cnt_sets) {
+    auto lock = csa_.lock();
+    sync_cache();
+    cur_state_ = csa_.get_state(state);
+    cnt_sets_ = cnt_sets;
+}
+
+void Config::save(FlowState& flow) const {
+    flow.state_ = cur_state_;
+    if (flow.cache_ != cache_) {
+        flow.cache_ = cache_;
+    }
+    flow.cnt_sets_.clear();
+    if (!cnt_sets_.empty()) {
+        encode_varint(flow.cnt_sets_, cnt_sets_.size());
+        for (auto const& cnt_set : cnt_sets_) {
+            cnt_set.encode(flow.cnt_sets_);
         }
     }
-    return lazy.update(index, sat_guards, csa_);
 }
 
-Matcher::Matcher(std::string_view pattern) : config_(CA::glushkov::Builder::get_ca(pattern)) { }
+void Config::resume(FlowState const& flow) {
+    if (!flow.started()) {
+        reset();
+        return;
+    }
+    if (flow.cache_ == cache_) {
+        cur_state_ = flow.state_;
+    } else {
+        // saved before a flush of the cache, or the config is behind it
+        auto lock = csa_.lock();
+        sync_cache();
+        cur_state_ = flow.cache_ == cache_ ? flow.state_ : csa_.get_state(flow.state_->state());
+    }
+    string_view data = flow.cnt_sets_;
+    size_t pos = 0;
+    cnt_sets_.resize(data.empty() ? 0 : decode_varint(data, pos));
+    for (auto& cnt_set : cnt_sets_) {
+        pos += cnt_set.decode(data.substr(pos));
+    }
+}
+
+Update const& Config::get_lazy_update(LazyTrans& lazy, uint8_t byte_class) {
+    uint64_t index = compute_update_index(lazy.guards());
+    if (auto update = lazy.find(index)) {
+        return *update;
+    }
+    auto lock = csa_.lock();
+    if (cache_ == csa_.states_) {
+        return lazy.update(index, csa_);
+    }
+    // the update must not be added to a flushed cache, the same state in
+    // the new cache has the same lazy transition
+    sync_cache();
+    Trans& trans = cur_state_->trans(byte_class);
+    if (trans.type() == TransEnum::NotComputed) {
+        compute_trans(trans, byte_class);
+    }
+    if (trans.type() != TransEnum::Lazy) {
+        FATAL_ERROR("unexpected type of transition", Errors::InternalFailure);
+    }
+    return trans.lazy()->update(index, csa_);
+}
+
+Matcher::Matcher(std::string_view pattern, std::pmr::memory_resource* resource)
+    : csa_(CA::glushkov::Builder::get_ca(pattern), resource),
+    config_(csa_), alive_(true), position_(0) { }
 
 bool Matcher::match(string_view text) {
-    for (char c : text) {
+    begin();
+    feed(text);
+    return finish();
+}
+
+void Matcher::begin() {
+    config_.reset();
+    alive_ = true;
+    position_ = 0;
+}
+
+bool Matcher::feed(string_view chunk) {
+    position_ += chunk.size();
+    if (!alive_) {
+        return false;
+    }
+    for (char c : chunk) {
         if (!config_.step(c)) {
-            config_.reset();
+            alive_ = false;
             return false;
         }
     }
-    bool res = config_.accepting();
+    return true;
+}
+
+void Matcher::save(FlowState& flow) const {
+    config_.save(flow);
+    flow.position_ = position_;
+}
+
+void Matcher::resume(FlowState const& flow) {
+    config_.resume(flow);
+    alive_ = !config_.dead();
+    position_ = flow.position_;
+}
+
+bool Matcher::finish() {
+    bool res = alive_ && config_.accepting();
+    config_.reset();
+    alive_ = true;
+    return res;
+}
+
+optional<size_t> Matcher::find_end(string_view text, size_t pos) {
+    // reset only clears the counting sets, their storage is kept
+    if (pos == 0) {
+        config_.reset();
+    } else {
+        config_.restart();
+    }
+    optional<size_t> end;
+    if (config_.accepting(pos == text.size())) {
+        end = pos;
+    }
+    for (size_t i = pos; !end && i < text.size(); ++i) {
+        if (!config_.step(text[i])) {
+            break;
+        }
+        if (config_.accepting(i + 1 == text.size())) {
+            end = i + 1;
+        }
+    }
+    config_.reset();
+    return end;
+}
+
+bool Matcher::match_within(string_view text, size_t start, size_t end) {
+    if (start == 0) {
+        config_.reset();
+    } else {
+        config_.restart();
+    }
+    bool res = true;
+    for (size_t i = start; res && i < end; ++i) {
+        res = config_.step(text[i]);
+    }
+    res = res && config_.accepting(end == text.size());
     config_.reset();
     return res;
 }
 
+optional<MatchSpan> Matcher::find(string_view text, size_t pos) {
+    auto end = find_end(text, pos);
+    if (!end) {
+        return nullopt;
+    }
+    // text[start, end) contains a match for every start up to the latest
+    // start of a match ending at end, so binary search can be used
+    size_t lo = pos;
+    size_t hi = *end;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (match_within(text, mid, *end)) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return MatchSpan{lo, *end};
+}
+
+size_t Matcher::count(string_view text) {
+    size_t matches = 0;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        auto end = find_end(text, pos);
+        if (!end) {
+            break;
+        }
+        ++matches;
+        // empty match, moving forward to not find it again
+        pos = (*end == pos) ? pos + 1 : *end;
+    }
+    return matches;
+}
+
+MatchIterator::MatchIterator(Matcher& matcher, string_view text)
+    : matcher_(&matcher), text_(text), span_() {
+    advance(0);
+}
+
+MatchIterator& MatchIterator::operator++() {
+    advance(span_.end == span_.start ? span_.end + 1 : span_.end);
+    return *this;
+}
+
+void MatchIterator::advance(size_t pos) {
+    if (pos > text_.size()) {
+        matcher_ = nullptr;
+        return;
+    }
+    auto span = matcher_->find(text_, pos);
+    if (span) {
+        span_ = *span;
+    } else {
+        matcher_ = nullptr;
+    }
+}
+
 // for debugging:
 
 string CounterState::to_str() const {
@@ -666,6 +1350,40 @@ string CounterState::to_str() const {
     return str + "}]"s;
 }
 
+string CounterStateView::to_str() const {
+    string str = "[S:"s + to_string(state()) + " {"s;
+    for (auto i : actual()) {
+        str += std::to_string(i) + ", "s;
+    }
+    str += "} +{"s;
+    for (auto i : postponed()) {
+        str += std::to_string(i) + ", "s;
+    }
+    return str + "}]"s;
+}
+
+uint64_t State::compute_hash() const {
+    // the sizes are mixed in as well, so that the indexes cannot move
+    // between the actual and postponed sets without changing the hash
+    uint64_t seed = hash_mix(0, normal_.size());
+    for (auto ca_state : normal_) {
+        seed = hash_mix(seed, ca_state);
+    }
+    seed = hash_mix(seed, counter_.size());
+    for (auto const& cnt_state : counter_) {
+        seed = hash_mix(seed, cnt_state.state());
+        seed = hash_mix(seed, cnt_state.actual().size());
+        for (auto index : cnt_state.actual()) {
+            seed = hash_mix(seed, index);
+        }
+        seed = hash_mix(seed, cnt_state.postponed().size());
+        for (auto index : cnt_state.postponed()) {
+            seed = hash_mix(seed, index);
+        }
+    }
+    return hash_finish(seed);
+}
+
 string State::to_str() const {
     string str = "Normal: {"s;
     for (auto const&i : normal_) {
@@ -739,9 +1457,9 @@ string Update::to_str() const {
     string str;
     switch(type_) {
         case UpdateEnum::Out:
-            return "OUT next:"s + next_state_->first.to_str();
+            return "OUT next:"s + next_state_->to_str();
         case UpdateEnum::Noop:
-            return "NOOP next:"s + next_state_->first.to_str();
+            return "NOOP next:"s + next_state_->to_str();
         case UpdateEnum::KeepSets:
             str += "KeepSets:\n"s;
             break;
@@ -749,15 +1467,15 @@ string Update::to_str() const {
             str += "NewSets:\n"s;
             break;
     }
-    for (auto const&inst : prog_) {
+    for (auto const&inst : prog()) {
         str += '\t' + inst.to_str() + '\n';
     }
-    return str + "next:"s + next_state_->first.to_str();
+    return str + "next:"s + next_state_->to_str();
 }
 
 string TransBuilder::to_str() const {
     string str = "Normal: {"s;
-    for (auto const&i : normal_) {
+    for (auto const&i : normal_.to_vec()) {
         str += std::to_string(i) + ", "s;
     }
     str += "} Counter: "s;
@@ -850,7 +1568,7 @@ string Update::DOT_label() const {
             str += "NewSets:\n"s;
             break;
     }
-    for (auto const&inst : prog_) {
+    for (auto const&inst : prog()) {
         str += '\t' + inst.to_str() + '\n';
     }
     return str;
@@ -859,16 +1577,16 @@ string Update::DOT_label() const {
 string Trans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_cnt,
                      std::unordered_map<State, unsigned> &state_ids,
                      std::unordered_map<uint8_t, std::string> &byte_dbg) const {
-    switch(type_) {
+    switch(type()) {
         case TransEnum::WithoutCntState:
         case TransEnum::EnteringCntState:
             {
-                if (next_state()->first.dead()) { return ""s; }
+                if (next_state()->dead()) { return ""s; }
                 unsigned id;
-                if (state_ids.contains(next_state()->first)) {
-                    id = state_ids[next_state()->first];
+                if (state_ids.contains(next_state()->state())) {
+                    id = state_ids[next_state()->state()];
                 } else {
-                    state_ids[next_state()->first] = id_cnt;
+                    state_ids[next_state()->state()] = id_cnt;
                     id = id_cnt;
                     id_cnt++;
                 }
@@ -876,21 +1594,21 @@ string Trans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_cnt,
             }
         case TransEnum::NoCondition:
             {
-                if (update()->next_state()->first.dead()) { return ""s; }
+                if (update()->next_state()->dead()) { return ""s; }
                 unsigned id;
-                if (state_ids.contains(update()->next_state()->first)) {
-                    id = state_ids[update()->next_state()->first];
+                if (state_ids.contains(update()->next_state()->state())) {
+                    id = state_ids[update()->next_state()->state()];
                 } else {
-                    state_ids[update()->next_state()->first] = id_cnt;
+                    state_ids[update()->next_state()->state()] = id_cnt;
                     id = id_cnt;
                     id_cnt++;
                 }
                 return to_string(origin_id) + " -> " + to_string(id) + "[label=\"" + byte_dbg[symbol] + "|" + update()->DOT_label() + "\"]\n";
             }
         case TransEnum::Small:
-            return this->small_->to_DOT(symbol, origin_id, id_cnt, state_ids, byte_dbg);
+            return small()->to_DOT(symbol, origin_id, id_cnt, state_ids, byte_dbg);
         case TransEnum::Lazy:
-            return this->lazy_->to_DOT(symbol, origin_id, id_cnt, state_ids, byte_dbg);
+            return lazy()->to_DOT(symbol, origin_id, id_cnt, state_ids, byte_dbg);
             assert(false);
         case TransEnum::NotComputed:
             break;
@@ -903,8 +1621,16 @@ std::string LazyTrans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_c
         std::unordered_map<uint8_t, std::string> &byte_dbg) const {
     std::vector<uint32_t> eval(guards().size(), 0);
     std::string graph;
-    for (auto const& [key, val] : cache_) {
-        if (val.next_state()->first.dead()) { continue; }
+    std::vector<Node const*> nodes;
+    for (auto const& bucket : buckets_) {
+        for (Node* node = bucket.load(std::memory_order_acquire); node; node = node->next) {
+            nodes.push_back(node);
+        }
+    }
+    for (Node const* node : nodes) {
+        auto key = node->index;
+        auto const& val = *node->update;
+        if (val.next_state()->dead()) { continue; }
         for (size_t j = 0; j < guards().size(); j++) {
             size_t d = guards().size() - j - 1; // the order of bits is descending
             if (key & (1<<d)) {
@@ -915,10 +1641,10 @@ std::string LazyTrans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_c
         }
         Update const& update = val;
         unsigned target_id;
-        if (state_ids.contains(update.next_state()->first)) {
-            target_id = state_ids[update.next_state()->first];
+        if (state_ids.contains(update.next_state()->state())) {
+            target_id = state_ids[update.next_state()->state()];
         } else {
-            state_ids[update.next_state()->first] = id_cnt;
+            state_ids[update.next_state()->state()] = id_cnt;
             target_id = id_cnt;
             id_cnt++;
         }
@@ -943,7 +1669,7 @@ std::string SmallTrans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_
     std::vector<uint32_t> eval(guards_.size(), 0);
     std::string graph;
     for (size_t i = 0; i < ((size_t)1<<guards_.size()); i++) {
-        if (updates_[i].next_state()->first.dead()) { continue; }
+        if (updates_[i]->next_state()->dead()) { continue; }
         for (size_t j = 0; j < guards_.size(); j++) {
             size_t d = guards_.size() - j - 1; // the order of bits is descending
             if (i & (1<<d)) {
@@ -952,12 +1678,12 @@ std::string SmallTrans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_
                 eval[j] = 0;
             }
         }
-        Update const& update = updates_[i];
+        Update const& update = *updates_[i];
         unsigned target_id;
-        if (state_ids.contains(update.next_state()->first)) {
-            target_id = state_ids[update.next_state()->first];
+        if (state_ids.contains(update.next_state()->state())) {
+            target_id = state_ids[update.next_state()->state()];
         } else {
-            state_ids[update.next_state()->first] = id_cnt;
+            state_ids[update.next_state()->state()] = id_cnt;
             target_id = id_cnt;
             id_cnt++;
         }
@@ -977,23 +1703,26 @@ std::string SmallTrans::to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_
 }
 
 std::string CSA::to_DOT() const {
+    auto lock = this->lock();
     std::unordered_map<uint8_t, std::string> byte_dbg = ca_.bytemap_debug();
     string str = "digraph CSA {\n"s;
     unsigned id_cnt{0};
     std::unordered_map<State, unsigned> state_ids;
-    for (auto & state : states_) {
-        if (state.first.dead()) { continue; }
+    for (StateIndex index = 0; index < states_->size(); ++index) {
+        CachedState const& cached = *states_->at(index);
+        if (cached.dead()) { continue; }
+        State state = cached.state();
         unsigned id;
-        if (state_ids.contains(state.first)) {
-            id = state_ids[state.first];
+        if (state_ids.contains(state)) {
+            id = state_ids[state];
         } else {
-            state_ids[state.first] = id_cnt;
+            state_ids[state] = id_cnt;
             id = id_cnt;
             id_cnt++;
         }
-        str += to_string(id) + "[shape=\"box\", label=\""s + state.first.DOT_label(*this) + "\"]\n"s;
-        for (unsigned i = 0; i < state.second.size(); i++) {
-            str += state.second[i].to_DOT(i, id, id_cnt, state_ids, byte_dbg);
+        str += to_string(id) + "[shape=\"box\", label=\""s + state.DOT_label(*this) + "\"]\n"s;
+        for (unsigned i = 0; i < ca_.bytemap_range(); i++) {
+            str += cached.trans(i).to_DOT(i, id, id_cnt, state_ids, byte_dbg);
         }
     }
     str += "start[style=invis]\nstart -> "s + to_string(state_ids[InitialState]) + "[color=\"red\"]\n"s;
@@ -1006,17 +1735,19 @@ std::string Config::csa_to_DOT() const {
 
 class CSATraverseState {
     public:
-    CSATraverseState(CSA & csa) : to_visit(), visited(), cur_state_(nullptr), csa_(csa) {
-        to_visit.insert(csa.get_state(InitialState)->first);
+    CSATraverseState(CSA & csa) : to_visit(), visited(), cur_state_(nullptr), csa_(csa),
+        builder_resource_(csa.resource()) {
+        to_visit.insert(csa.get_state(InitialState)->state());
     }
 
     bool keep_going() const { return !to_visit.empty(); }
     void compute_full_trans(Trans& trans, uint8_t byte_class) {
-        if (cur_state_->first.counter().empty()) {
-            NormalStateVec normal;
-            CounterStateVec counter;
+        builder_resource_.reset();
+        if (cur_state_->counter_count() == 0) {
+            StateSet normal(csa_.ca().state_count(), &builder_resource_);
+            CounterStateMap counter;
             CountersToReset reset;
-            for (auto ca_state : cur_state_->first.normal()) {
+            for (auto ca_state : cur_state_->normal()) {
                 auto& ca_transitions = csa_.ca().get_state(ca_state).transitions();
                 for (auto& ca_trans : ca_transitions) {
                     if (ca_trans.symbol() != byte_class 
@@ -1027,28 +1758,29 @@ class CSATraverseState {
                         normal.insert(ca_trans.target());
                     } else {
                         assert(ca_trans.op() == CA::Operator::Rst);
-                        counter.insert(CounterState(ca_trans.target()));
+                        counter.insert(ca_trans.target());
                         reset.add_state(ca_trans.target(), 
                                 csa_.ca().get_state(ca_trans.target()).cnt());
                     }
                 }
             }
             if (counter.empty()) {
-                State state(std::move(normal), std::move(counter), 0);
+                State state(normal.to_vec(), std::move(counter), 0);
                 trans.set_next_state(csa_.get_state(std::move(state)), TransEnum::WithoutCntState);
             } else {
                 auto names = reset.get_cnt_set_names();
                 auto it = names.begin();
                 for (unsigned i = 0; i < names.size(); ++i, ++it) {
                     for (auto state : *it) {
-                        counter.find(CounterState(state))->actual().insert(i);
+                        counter.at(state).actual().insert(i);
                     }
                 }
-                State state(std::move(normal), std::move(counter), names.size());
+                State state(normal.to_vec(), std::move(counter), names.size());
                 trans.set_next_state(csa_.get_state(std::move(state)), TransEnum::EnteringCntState);
             }
         } else {
-            GuardedTransBuilder builder(csa_.ca(), cur_state_->first, byte_class);
+            GuardedTransBuilder builder(csa_.ca(), cur_state_->state(), byte_class,
+                    &builder_resource_);
             switch (builder.trans_type()) {
                 case TransEnum::NoCondition:
                     trans.set_update(builder.no_condition(csa_));
@@ -1057,7 +1789,7 @@ class CSATraverseState {
                     trans.set_small(builder.small(csa_));
                     break;
                 case TransEnum::Lazy:
-                    trans.set_lazy(new LazyTrans(std::move(builder)));
+                    trans.set_lazy(new LazyTrans(builder));
                     break;
                 default:
                     FATAL_ERROR("unexpected trans type of builder", Errors::InternalFailure);
@@ -1074,36 +1806,25 @@ class CSATraverseState {
     void collect_next_states(Trans &trans, uint8_t symbol) {
         switch (trans.type()) {
             case TransEnum::WithoutCntState:
-                add_state(trans.next_state()->first);
+                add_state(trans.next_state()->state());
                 break;
             case TransEnum::EnteringCntState:
-                add_state(trans.next_state()->first);
+                add_state(trans.next_state()->state());
                 break;
             case TransEnum::NoCondition:
-                add_state(trans.update()->next_state()->first);
+                add_state(trans.update()->next_state()->state());
                 break;
             case TransEnum::Small:
-                for (auto &update : trans.small()->updates()) {
-                    add_state(update.next_state()->first);
+                for (auto const* update : trans.small()->updates()) {
+                    add_state(update->next_state()->state());
                 }
                 break;
             case TransEnum::Lazy:
             {
                 auto & lazy = *trans.lazy();
-                auto const& guards = lazy.guards();
-                std::vector<bool> eval(guards.size(), 0);
-                std::string graph;
-                for (size_t i = 0; i < ((size_t)1<<guards.size()); i++) {
-                    for (size_t j = 0; j < guards.size(); j++) {
-                        size_t d = guards.size() - j - 1; // the order of bits is descending
-                        if (i & (1<<d)) {
-                            eval[j] = true;
-                        } else {
-                            eval[j] = false;
-                        }
-                        auto const& update = trans.lazy()->update(i, eval, csa_);
-                        add_state(update.next_state()->first);
-                    }
+                for (uint64_t i = 0; i < (uint64_t(1) << lazy.guards().size()); i++) {
+                    auto const& update = lazy.update(i, csa_);
+                    add_state(update.next_state()->state());
                 }
             }
                 break;
@@ -1116,10 +1837,10 @@ class CSATraverseState {
         while (keep_going()) {
             cur_state_ = csa_.get_state(*to_visit.begin());
             to_visit.erase(to_visit.begin());
-            visited.insert(cur_state_->first);
+            visited.insert(cur_state_->state());
             for (uint8_t i = 0; i < csa_.ca().bytemap_range(); i++) {
-                compute_full_trans(cur_state_->second[i], i);
-                collect_next_states(cur_state_->second[i], i);
+                compute_full_trans(cur_state_->trans(i), i);
+                collect_next_states(cur_state_->trans(i), i);
             }
         }
     }
@@ -1129,9 +1850,11 @@ class CSATraverseState {
     std::unordered_set<State> to_visit;
     std::unordered_set<State> visited;
     CachedState* cur_state_;
+    ScratchResource builder_resource_;
 };
 
 void CSA::compute_full() {
+    auto lock = this->lock();
     auto state = CSATraverseState(*this);
     state.run();
 }
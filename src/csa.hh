@@ -1,8 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cstdint>
+#include <deque>
+#include <iterator>
+#include <limits>
 #include <list>
+#include <memory_resource>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <string_view>
+#include <type_traits>
 #include <sys/types.h>
 #include <vector>
 #include <unordered_map>
@@ -10,6 +23,7 @@
 
 #include "ca.hh"
 #include "ord_vector.hh"
+#include "small_vector.hh"
 #include "csa_errors.hh"
 
 
@@ -58,57 +72,167 @@ namespace CSA {
     template<typename T>
     using OrdVector = Mata::Util::OrdVector<T>;
     using CounterIndex = unsigned;
-    using IndexVec = OrdVector<CounterIndex>;
 
-    class CounterState {
+    // sorted set of the indexes of counting sets, a counter state is
+    // usually in a few of them
+    class IndexSet {
         public:
-        CounterState() : state_(), actual_(), postponed_() {};
-        CounterState(CA::StateId state) : state_(state), actual_(), postponed_() {};
-        CounterState(CA::StateId state, IndexVec actual, IndexVec postponed) :
-            state_(state), actual_(actual), postponed_(postponed) {};
+        IndexSet() : vec_() {}
 
-        bool operator<(const CounterState &other) const {
-            return state_ < other.state_;
+        void insert(CounterIndex index) {
+            auto pos = std::lower_bound(vec_.begin(), vec_.end(), index);
+            if (pos == vec_.end() || *pos != index) {
+                vec_.insert(pos, index);
+            }
         }
 
+        CounterIndex const* begin() const { return vec_.begin(); }
+        CounterIndex const* end() const { return vec_.end(); }
+        uint32_t size() const { return vec_.size(); }
+        bool empty() const { return vec_.empty(); }
+        bool operator==(IndexSet const& other) const { return vec_ == other.vec_; }
+
+        private:
+        SmallVector<CounterIndex, 4> vec_;
+    };
+
+    class CounterState {
+        public:
+        CounterState(CA::StateId state) : state_(state), actual_(), postponed_() {};
+
         bool operator==(const CounterState &other) const {
-            return state_ == other.state_;
+            return state_ == other.state_ && actual_ == other.actual_
+                && postponed_ == other.postponed_;
         }
 
         CA::StateId state() const { return state_; }
-        IndexVec & actual() const { return actual_; }
-        IndexVec & postponed() const { return postponed_; }
+        IndexSet & actual() { return actual_; }
+        IndexSet & postponed() { return postponed_; }
+        IndexSet const& actual() const { return actual_; }
+        IndexSet const& postponed() const { return postponed_; }
 
         std::string to_str() const;
 
         private:
         CA::StateId state_;
-        // mutable to be able to use the OrdVector as map
-        // TODO: Implement Flat map using ordered vector to replace OrdVec here
-        mutable IndexVec actual_;
-        mutable IndexVec postponed_;
+        IndexSet actual_;
+        IndexSet postponed_;
+    };
+
+    // Counter states of a CSA state, a flat map sorted by the CA state.
+    class CounterStateMap {
+        public:
+        using const_iterator = std::vector<CounterState>::const_iterator;
+
+        CounterStateMap() : states_() {}
+
+        // returns the counter state of the CA state, added if missing
+        CounterState& insert(CA::StateId state) {
+            auto pos = lower_bound(state);
+            if (pos == states_.end() || pos->state() != state) {
+                pos = states_.insert(pos, CounterState(state));
+            }
+            return *pos;
+        }
+        // the counter state of the CA state must be in the map
+        CounterState& at(CA::StateId state) {
+            auto pos = lower_bound(state);
+            assert(pos != states_.end() && pos->state() == state);
+            return *pos;
+        }
+        // appends a state larger than all in the map
+        CounterState& push_back(CA::StateId state) {
+            assert(states_.empty() || states_.back().state() < state);
+            return states_.emplace_back(state);
+        }
+
+        const_iterator begin() const { return states_.begin(); }
+        const_iterator end() const { return states_.end(); }
+        size_t size() const { return states_.size(); }
+        bool empty() const { return states_.empty(); }
+        bool operator==(CounterStateMap const& other) const { return states_ == other.states_; }
+
+        private:
+        std::vector<CounterState>::iterator lower_bound(CA::StateId state) {
+            return std::lower_bound(states_.begin(), states_.end(), state,
+                    [](CounterState const& cnt_state, CA::StateId state) {
+                        return cnt_state.state() < state;
+                    });
+        }
+
+        std::vector<CounterState> states_;
     };
 
-    using CounterStateVec = OrdVector<CounterState>;
     using NormalStateVec = OrdVector<CA::StateId>;
+
+    // Set of CA states collected while computing a transition. Up to
+    // max_dense_states it is a bitset, so adding a state, copying and
+    // listing the set are word operations. For larger CAs the states are
+    // appended and sorted once when listed.
+    class StateSet {
+        public:
+        StateSet(size_t state_count, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+            : bits_(state_count <= max_dense_states ? (state_count + 63) / 64 : 0, resource),
+            sparse_(resource) {}
+        StateSet(StateSet const& other, std::pmr::memory_resource* resource)
+            : bits_(other.bits_, resource), sparse_(other.sparse_, resource) {}
+
+        void insert(CA::StateId state) {
+            if (dense()) {
+                bits_[state / 64] |= uint64_t(1) << (state % 64);
+            } else {
+                sparse_.push_back(state);
+            }
+        }
+
+        // the states in ascending order
+        NormalStateVec to_vec() const;
+
+        private:
+        static constexpr size_t max_dense_states = 1 << 16;
+
+        bool dense() const { return !bits_.empty(); }
+
+        std::pmr::vector<uint64_t> bits_;
+        std::pmr::vector<CA::StateId> sparse_;
+    };
     class CSA;
 
+    // mixes a word into the hash of a state, the multiplier is the 64 bit
+    // golden ratio and the xor-shift spreads the high bits back down
+    inline uint64_t hash_mix(uint64_t seed, uint64_t value) {
+        seed = (seed ^ value) * 0x9e3779b97f4a7c15ULL;
+        return seed ^ (seed >> 32);
+    }
+
+    // finalizer of MurmurHash3
+    inline uint64_t hash_finish(uint64_t seed) {
+        seed ^= seed >> 33;
+        seed *= 0xff51afd7ed558ccdULL;
+        seed ^= seed >> 33;
+        seed *= 0xc4ceb9fe1a85ec53ULL;
+        return seed ^ (seed >> 33);
+    }
+
+    // State of the CSA, immutable once constructed. The hash is computed
+    // with the state, so that looking it up in the cache does not walk the
+    // counter states again.
     class State {
         public:
-        State(NormalStateVec &&normal, CounterStateVec &&counter, unsigned cnt_sets) :
-            normal_(std::move(normal)), counter_(std::move(counter)), cnt_sets_(cnt_sets) {};
+        State(NormalStateVec &&normal, CounterStateMap &&counter, unsigned cnt_sets) :
+            normal_(std::move(normal)), counter_(std::move(counter)), cnt_sets_(cnt_sets),
+            hash_(compute_hash()) {};
 
         State(State const& other) = default;
 
-        NormalStateVec & normal() { return normal_; }
-        CounterStateVec & counter() { return counter_; }
-
         NormalStateVec const& normal() const { return normal_; }
-        CounterStateVec const& counter() const { return counter_; }
+        CounterStateMap const& counter() const { return counter_; }
         unsigned cnt_sets() const { return cnt_sets_; }
+        uint64_t hash() const { return hash_; }
 
         bool operator==(const State &other) const {
-            return normal_ == other.normal_
+            return hash_ == other.hash_
+                && normal_ == other.normal_
                 && counter_ == other.counter_;
         }
 
@@ -118,62 +242,56 @@ namespace CSA {
         std::string DOT_label(CSA const& csa) const;
 
         private:
+        uint64_t compute_hash() const;
+
         NormalStateVec normal_;
-        CounterStateVec counter_;
+        CounterStateMap counter_;
         unsigned cnt_sets_;
+        uint64_t hash_;
     };
 
-    // from boost:
-    // https://www.boost.org/doc/libs/1_35_0/doc/html/boost/hash_combine_id241013.html
-    // license: https://www.boost.org/LICENSE_1_0.txt
-    template<typename T> static void hash_combine(size_t &seed, T const &val) {
-        seed ^= std::hash<T>()(val) + 0x9e3779b9 + (seed<<6) + (seed>>2);
-    }
-
 } // namespace CSA
 
 namespace std {
     template <>
     struct hash<CSA::State> {
         std::size_t operator()(const CSA::State& state) const {
-            size_t seed = 0;
-            for (CA::StateId ca_state : state.normal()) {
-                CSA::hash_combine(seed, ca_state);
-            }
-            for (CSA::CounterState const& state : state.counter()) {
-                CSA::hash_combine(seed, state.state());
-                for (CSA::CounterIndex const& index : state.actual()) {
-                    CSA::hash_combine(seed, index);
-                }
-                for (CSA::CounterIndex const& index : state.postponed()) {
-                    CSA::hash_combine(seed, index);
-                }
-            }
-            return seed;
+            return state.hash();
         }
     };
 }
 
 namespace CSA {
 
+    // 64 bit so that counters in unbounded repetitions do not overflow on
+    // inputs longer than 4GB
+    using CounterValue = uint64_t;
+
     class CountingSet {
         public:
+        // the sets of a config take the memory resource of its vector of
+        // sets (uses-allocator construction)
+        using allocator_type = std::pmr::polymorphic_allocator<CounterValue>;
+
         CountingSet() : list_(), offset_(1) { }
-        CountingSet(unsigned val) :  list_({0,}), offset_(val) { }
+        explicit CountingSet(allocator_type alloc) : list_(alloc), offset_(1) { }
+        CountingSet(CounterValue val, allocator_type alloc = {}) : list_({0,}, alloc), offset_(val) { }
 
         CountingSet(CountingSet && other) : list_(std::move(other.list_)),
             offset_(other.offset_) {}
-        CountingSet(CountingSet const& other) : list_(other.list_),
+        CountingSet(CountingSet && other, allocator_type alloc) : list_(std::move(other.list_), alloc),
+            offset_(other.offset_) {}
+        CountingSet(CountingSet const& other, allocator_type alloc = {}) : list_(other.list_, alloc),
             offset_(other.offset_) {}
 
-        unsigned offset() const { return offset_; }
-        std::list<unsigned> const& list() const { return list_; }
+        CounterValue offset() const { return offset_; }
+        std::pmr::list<CounterValue> const& list() const { return list_; }
 
-        unsigned max() const { return offset_ - list_.back(); }
-        unsigned min() const { return offset_ - list_.front(); }
+        CounterValue max() const { return offset_ - list_.back(); }
+        CounterValue min() const { return offset_ - list_.front(); }
 
-        unsigned max_postponed(int max) const;
-        unsigned min_postponed() const;
+        CounterValue max_postponed(int max) const;
+        CounterValue min_postponed() const;
 
         CountingSet &operator=(CountingSet &&other) {
             offset_ = other.offset_;
@@ -193,17 +311,22 @@ namespace CSA {
         void rst_to_1();
         void insert_1();
 
+        // compact encoding of the values using varints, used by FlowState
+        void encode(std::string& out) const;
+        // returns the number of bytes read from data
+        size_t decode(std::string_view data);
+
         // for testing only
-        std::vector<unsigned> to_vec() const;
+        std::vector<CounterValue> to_vec() const;
 
         std::string to_str() const;
 
         private:
-        std::list<unsigned> list_; 
-        unsigned offset_;
+        std::pmr::list<CounterValue> list_; 
+        CounterValue offset_;
     };
 
-    using CntSetVec = std::vector<CountingSet>;
+    using CntSetVec = std::pmr::vector<CountingSet>;
 
     enum class LValueEnum {
         ID,
@@ -229,19 +352,24 @@ namespace CSA {
     };
 
     using LValueRowIndex = unsigned;
+    using LValueRow = SmallVector<LValue, 8>;
 
     class LValueTable {
         public:
-        LValueTable(unsigned size) : tab_(size, std::vector<LValue>{}) { }
+        LValueTable(unsigned size, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+            : tab_(size, resource) { }
+        LValueTable(LValueTable const& other, std::pmr::memory_resource* resource)
+            : tab_(other.tab_, resource) { }
 
         void add_lval(CA::StateId state, LValueEnum type, LValueRowIndex index);
         size_t size() const { return tab_.size(); }
-        std::vector<LValue> & operator[](LValueRowIndex index) { return tab_[index]; }
+        LValueRow & operator[](LValueRowIndex index) { return tab_[index]; }
+        std::pmr::memory_resource* resource() const { return tab_.get_allocator().resource(); }
 
         std::string to_str() const;
 
         private:
-        std::vector<std::vector<LValue>> tab_;
+        std::pmr::vector<LValueRow> tab_;
     };
 
     class CounterToReset {
@@ -292,6 +420,11 @@ namespace CSA {
         CntSetInst(CntSetInstEnum type, unsigned arg) : 
             type_(type), origin_(arg), target_(arg) {}
 
+        bool operator==(CntSetInst const& other) const {
+            // the arguments of Incr share the storage with origin and target
+            return type_ == other.type_ && origin_ == other.origin_ && target_ == other.target_;
+        }
+
         CntSetInstEnum type() const { return type_; }
         unsigned origin() const { return origin_; }
         unsigned target() const { return target_; }
@@ -316,11 +449,11 @@ namespace CSA {
         };
     };
 
-    using UpdateProg = std::vector<CntSetInst>;
+    using UpdateProg = std::pmr::vector<CntSetInst>;
 
     struct Trans;
 
-    using CachedState = std::pair<const State, std::vector<Trans>>;
+    class CachedState;
 
     enum class UpdateEnum {
         Out,
@@ -329,38 +462,103 @@ namespace CSA {
         NewSets,
     };
 
-    // compiled update
+    // compiled update, interned in the UpdatePool of the state cache so
+    // that equal updates of different transitions are stored once
     class Update {
         public:
-        Update(UpdateEnum type, CachedState *next_state, UpdateProg &&prog) 
-            : type_(type), next_state_(next_state), prog_(std::move(prog)) {}
-        Update() : type_(), next_state_(), prog_() {}
-
-        Update(Update&&) = default;
-        Update(Update const&) = default;
-        ~Update() = default;
-        Update& operator=(Update const&) = default;
-
-        void add_inst(CntSetInstEnum type, unsigned arg1, unsigned arg2) {
-            prog_.emplace_back(type, arg1, arg2);
-        }
-        void set_next_state(CachedState *next_state) { next_state_ = next_state; }
-        void optimize(size_t new_size);
+        Update(UpdateEnum type, CachedState *next_state, CntSetInst const* prog, uint32_t prog_size) 
+            : type_(type), prog_size_(prog_size), next_state_(next_state), prog_(prog) {}
 
         UpdateEnum type() const { return type_; }
         CachedState *next_state() const { return next_state_; }
-        UpdateProg const& prog() const { return prog_; }
+        std::span<const CntSetInst> prog() const { return {prog_, prog_size_}; }
+        size_t memory() const { return sizeof(Update) + prog_size_ * sizeof(CntSetInst); }
 
         std::string to_str() const;
         std::string DOT_label() const;
 
         private:
         UpdateEnum type_;
+        uint32_t prog_size_;
         CachedState *next_state_;
-        UpdateProg prog_;
+        // points to the program arena of the pool
+        CntSetInst const* prog_;
+    };
+
+    // Bump allocator of trivially destructible values in blocks taken from
+    // a memory resource. The values never move and are freed together.
+    template<typename T>
+    class BlockArena {
+        static_assert(std::is_trivially_destructible_v<T>);
+
+        public:
+        BlockArena(std::pmr::memory_resource* resource, size_t block_size)
+            : alloc_(resource), blocks_(resource), block_size_(block_size), free_(nullptr), left_(0) {}
+        BlockArena(BlockArena const&) = delete;
+        BlockArena& operator=(BlockArena const&) = delete;
+        ~BlockArena() { clear(); }
+
+        // uninitialized storage for n values
+        T* alloc(size_t n) {
+            if (n > left_) {
+                size_t size = std::max(n, block_size_);
+                blocks_.emplace_back(alloc_.allocate(size), size);
+                free_ = blocks_.back().first;
+                left_ = size;
+            }
+            T* values = free_;
+            free_ += n;
+            left_ -= n;
+            return values;
+        }
+
+        void clear() {
+            for (auto [block, size] : blocks_) {
+                alloc_.deallocate(block, size);
+            }
+            blocks_.clear();
+            free_ = nullptr;
+            left_ = 0;
+        }
+
+        private:
+        std::pmr::polymorphic_allocator<T> alloc_;
+        std::pmr::vector<std::pair<T*, size_t>> blocks_;
+        size_t block_size_;
+        T* free_;
+        size_t left_;
+    };
+
+    // Hash-consed updates of a state cache. The updates are stored in
+    // stable blocks and their programs back to back in an arena, the
+    // computed transitions point to them and do not own them.
+    class UpdatePool {
+        public:
+        UpdatePool(std::pmr::memory_resource* resource) : updates_(resource),
+            progs_(resource, prog_block_insts), index_(resource), size_(0) {}
+        UpdatePool(UpdatePool const&) = delete;
+        UpdatePool& operator=(UpdatePool const&) = delete;
+
+        // returns the interned update, added is set if it was not there
+        Update const* get(UpdateEnum type, CachedState* next_state, UpdateProg const& prog, bool& added);
+        size_t size() const { return size_; }
+        void clear();
+
+        private:
+        static constexpr size_t prog_block_insts = 1 << 12;
+        static constexpr size_t first_index_size = 64;
+
+        void grow_index();
+
+        // the deque does not move its elements when appended to
+        std::pmr::deque<Update> updates_;
+        BlockArena<CntSetInst> progs_;
+        // open addressing with linear probing like the index of the states
+        std::pmr::vector<std::pair<uint64_t, Update const*>> index_;
+        size_t size_;
     };
 
-    using UpdateVec = std::vector<Update>;
+    using UpdateVec = std::vector<Update const*>;
 
     struct Guard {
         std::string DOT_label() const;
@@ -381,18 +579,19 @@ namespace CSA {
     const size_t max_conditions_in_small_trans = 2;
 
     using GuardVec = std::vector<Guard>;
-    using GuardedStates = std::vector<std::vector<CA::StateId>>;
-    using GuardedLvals = std::vector<std::vector<std::pair<LValue, LValueRowIndex>>>;
-    using GuardedResets = std::vector<std::vector<std::pair<CA::StateId, CA::CounterId>>>;
+    // the rows are indexed by the guards, a guard rarely adds more than a few
+    using GuardedStates = std::pmr::vector<SmallVector<CA::StateId, 8>>;
+    using GuardedLvals = std::pmr::vector<SmallVector<std::pair<LValue, LValueRowIndex>, 8>>;
+    using GuardedResets = std::pmr::vector<SmallVector<std::pair<CA::StateId, CA::CounterId>, 8>>;
 
     class SmallTrans {
         public:
         SmallTrans(GuardVec&& guards) : guards_(std::move(guards)), updates_() {}
 
-        void add_update(Update&& update) { updates_.push_back(std::move(update)); }
+        void add_update(Update const* update) { updates_.push_back(update); }
         GuardVec const& guards() const { return guards_; }
-        Update const& update(unsigned index) const { return updates_[index]; }
-        UpdateVec & updates() { return updates_; }
+        Update const& update(unsigned index) const { return *updates_[index]; }
+        UpdateVec const& updates() const { return updates_; }
 
         std::string to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_cnt,
                 std::unordered_map<State, unsigned> &state_ids,
@@ -403,27 +602,28 @@ namespace CSA {
         UpdateVec updates_;
     };
 
-    using UpdateCache = std::unordered_map<uint64_t, Update>;
-
     class TransBuilder {
         public:
-        TransBuilder(unsigned lval_table_size) : 
-            normal_(), counter_(), lvals_(lval_table_size), cnts_to_reset_() {}
+        TransBuilder(size_t state_count, unsigned lval_table_size, std::pmr::memory_resource* resource) :
+            normal_(state_count, resource), counter_(), lvals_(lval_table_size, resource),
+            cnts_to_reset_() {}
 
-        TransBuilder(NormalStateVec const& normal, CounterStateVec const& counter,
+        // the copy takes its temporaries from the resource of the table
+        TransBuilder(StateSet const& normal, CounterStateMap const& counter,
                 LValueTable const& lvals, CountersToReset const& cnts_to_reset) :
-            normal_(normal), counter_(counter), lvals_(lvals), cnts_to_reset_(cnts_to_reset) {}
+            normal_(normal, lvals.resource()), counter_(counter), lvals_(lvals, lvals.resource()),
+            cnts_to_reset_(cnts_to_reset) {}
 
         // do not use again after calling this function
-        Update compute_update(CSA& csa);
+        Update const* compute_update(CSA& csa);
 
         void add_normal_state(CA::StateId state) { normal_.insert(state); }
         void add_lval(LValue lval, LValueRowIndex index) {
             lvals_.add_lval(lval.state(), lval.type(), index);
-            counter_.insert(CounterState(lval.state()));
+            counter_.insert(lval.state());
         }
         void add_rst(CA::StateId state, CA::CounterId counter) { 
-            counter_.insert(CounterState(state));
+            counter_.insert(state);
             cnts_to_reset_.add_state(state, counter); 
         }
 
@@ -431,19 +631,21 @@ namespace CSA {
         std::string to_DOT(uint32_t origin_id) const;
 
         private:
-        OrdVector<OrdVector<CA::StateId>> compute_state_idexes(CSA& csa, Update& update);
+        OrdVector<OrdVector<CA::StateId>> compute_state_idexes(CSA& csa, UpdateProg& prog);
 
         protected:
-        NormalStateVec normal_;
-        CounterStateVec counter_;
+        StateSet normal_;
+        CounterStateMap counter_;
         LValueTable lvals_;
         CountersToReset cnts_to_reset_;
     };
 
+    // Builds the transitions of a state with counters. The temporaries are
+    // taken from the resource, the builder must not outlive it.
     class GuardedTransBuilder : public TransBuilder {
         public:
-        GuardedTransBuilder(CA::CA<uint8_t> const& ca, State const &state,
-                uint8_t symbol);
+        GuardedTransBuilder(CA::CA<uint8_t> const& ca, State const &state, uint8_t symbol,
+                std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
         void add_cnt_state(CA::CA<uint8_t> const& ca, CounterState const &cnt_state,
                 uint8_t symbol);
@@ -451,11 +653,11 @@ namespace CSA {
         TransEnum trans_type() const;
 
         // can be called multipletimes
-        Update create_update(std::vector<bool> const &sat_guards, CSA &csa);
+        Update const* create_update(std::vector<bool> const &sat_guards, CSA &csa);
 
         // after calling those function the builder must not be used again
         SmallTrans *small(CSA &csa);
-        Update *no_condition(CSA &csa);
+        Update const* no_condition(CSA &csa);
 
 
         private:
@@ -467,42 +669,82 @@ namespace CSA {
         GuardedResets guarded_resets_;
     };
 
+    // Updates of a transition with too many guards to compute them all,
+    // each is computed when the combination of satisfied guards is seen.
+    // The computed updates are kept in lists that are only prepended to,
+    // so they can be read without a lock while another thread adds one.
     class LazyTrans {
         public:
-        LazyTrans(GuardedTransBuilder&& builder) : builder_(std::move(builder)), cache_() {}
+        // copies of pmr containers take the default resource, so the copy
+        // of the builder does not point to the memory it was built in
+        LazyTrans(GuardedTransBuilder const& builder) : builder_(builder), buckets_() {}
+        LazyTrans(LazyTrans const&) = delete;
+        LazyTrans& operator=(LazyTrans const&) = delete;
+        ~LazyTrans();
+
         GuardVec const& guards() const { return builder_.guards(); }
-        Update const &update(unsigned index,
-                             std::vector<bool> const &sat_guards, CSA &csa);
+        // bit i of the index is set if guard i is satisfied
+        Update const &update(uint64_t index, CSA &csa);
+        // null if the update was not computed yet, does not lock
+        Update const* find(uint64_t index) const;
+        // adds an update computed elsewhere, the lock of the CSA must be held
+        void add(uint64_t index, Update const* update);
+        // approximate memory of the transition, the updates are in the pool
+        size_t memory() const;
+        // calls f(index, update) for the computed updates
+        template<typename F> void for_each(F f) const {
+            for (auto const& bucket : buckets_) {
+                for (Node* node = bucket.load(std::memory_order_acquire); node; node = node->next) {
+                    f(node->index, *node->update);
+                }
+            }
+        }
 
         std::string to_DOT(uint8_t symbol, uint32_t origin_id, unsigned &id_cnt,
                 std::unordered_map<State, unsigned> &state_ids,
                 std::unordered_map<uint8_t, std::string> &byte_dbg) const;
 
       private:
+        struct Node {
+            uint64_t index;
+            Update const* update;
+            Node* next;
+        };
+        static const size_t bucket_count = 16;
+
         GuardedTransBuilder builder_;
-        UpdateCache cache_;
+        std::array<std::atomic<Node*>, bucket_count> buckets_;
     };
 
+    // The transition is computed once by the first config that takes it
+    // and then shared by all configs of the CSA. It is a single tagged
+    // word: the pointer to the next state or to the payload with the
+    // TransEnum in its low bits. Publishing a computed transition is one
+    // release store, readers load it without locking.
     class Trans {
         public:
-        Trans() : type_(TransEnum::NotComputed) {}
-
-        void set_next_state(CachedState* next_state, TransEnum type) { type_ = type; next_state_ = next_state; }
-        void set_small(SmallTrans* small) { type_ = TransEnum::Small; small_ = small; }
-        void set_update(Update* update) { type_ = TransEnum::NoCondition; update_ = update; }
-        void set_lazy(LazyTrans* lazy) { type_ = TransEnum::Lazy; lazy_ = lazy; }
+        Trans() : word_(0) {}
+        Trans(Trans const&) = delete;
+        Trans& operator=(Trans const&) = delete;
 
+        void set_next_state(CachedState* next_state, TransEnum type) { publish(next_state, type); }
+        void set_small(SmallTrans* small) { publish(small, TransEnum::Small); }
+        void set_update(Update const* update) { publish(const_cast<Update*>(update), TransEnum::NoCondition); }
+        void set_lazy(LazyTrans* lazy) { publish(lazy, TransEnum::Lazy); }
 
-        TransEnum type() const { return type_; }
+        TransEnum type() const {
+            return static_cast<TransEnum>(word_.load(std::memory_order_acquire) & tag_mask);
+        }
+        // approximate memory owned by the transition
+        size_t memory() const;
 
         CachedState* next_state() const { 
-            assert(type_ == TransEnum::WithoutCntState || type_ == TransEnum::EnteringCntState);
-            return next_state_; 
+            assert(type() == TransEnum::WithoutCntState || type() == TransEnum::EnteringCntState);
+            return static_cast<CachedState*>(pointer());
         }
-        Update* update() { assert(type_ == TransEnum::NoCondition); return update_; }
-        Update const* update() const { assert(type_ == TransEnum::NoCondition); return update_; }
-        SmallTrans* small() { assert(type_ == TransEnum::Small); return small_; }
-        LazyTrans* lazy() { assert(type_ == TransEnum::Lazy); return lazy_; }
+        Update const* update() const { assert(type() == TransEnum::NoCondition); return static_cast<Update*>(pointer()); }
+        SmallTrans* small() const { assert(type() == TransEnum::Small); return static_cast<SmallTrans*>(pointer()); }
+        LazyTrans* lazy() const { assert(type() == TransEnum::Lazy); return static_cast<LazyTrans*>(pointer()); }
 
         std::string to_str() const;
 
@@ -513,26 +755,203 @@ namespace CSA {
         ~Trans();
 
         private:
-        TransEnum type_;
-        union {
-            CachedState* next_state_;
-            Update* update_;
-            SmallTrans* small_;
-            LazyTrans* lazy_;
-        };
+        static constexpr uintptr_t tag_mask = 7;
+
+        void publish(void* target, TransEnum type) {
+            assert((reinterpret_cast<uintptr_t>(target) & tag_mask) == 0);
+            word_.store(reinterpret_cast<uintptr_t>(target) | static_cast<uintptr_t>(type),
+                    std::memory_order_release);
+        }
+        // the word does not change once computed and the type was loaded
+        // with acquire before, so the pointer can be loaded relaxed
+        void* pointer() const {
+            return reinterpret_cast<void*>(word_.load(std::memory_order_relaxed) & ~tag_mask);
+        }
+
+        std::atomic<uintptr_t> word_;
     };
+    static_assert(sizeof(Trans) == sizeof(void*));
 
     const State InitialState = State({CA::InitState, }, {}, 0);
 
-    using TransVec = std::vector<Trans>;
-    using StateCache = std::unordered_map<State, TransVec>;
+    // state of a search restarted inside the text, only the loop in front
+    // of the unanchored patterns is left so a start anchor can not match
+    inline State restart_state(CA::CA<uint8_t> const& ca) {
+        if (ca.any_loop_start() == CA::InitState) {
+            return State({}, {}, 0);
+        }
+        return State({ca.any_loop_start(), }, {}, 0);
+    }
+
+    using StateIndex = uint32_t;
 
-    class CSA {
+    // Counter state of an interned state, points to the blob of the state.
+    class CounterStateView {
+        public:
+        CounterStateView(uint32_t const* blob, uint32_t const* record) : blob_(blob), record_(record) {}
+
+        CA::StateId state() const { return record_[0]; }
+        std::span<const CounterIndex> actual() const { return {blob_ + record_[1], record_[2]}; }
+        std::span<const CounterIndex> postponed() const {
+            return {blob_ + record_[1] + record_[2], record_[3]};
+        }
+
+        std::string to_str() const;
+
+        private:
+        uint32_t const* blob_;
+        uint32_t const* record_;
+    };
+
+    // State interned in a StateCache. Its contents are encoded in the blob
+    // arena of the cache:
+    //   normal count, normal states, counter count,
+    //   counter count times (state, offset of indexes, actual count, postponed count),
+    //   the actual and postponed indexes of the counter states
+    // The cached state never moves, so transitions point to it directly.
+    class CachedState {
+        public:
+        CachedState() : blob_(nullptr), trans_(nullptr), size_(0), id_(0), cnt_sets_(0) {}
+
+        // dense index in the cache, used to serialize the cache
+        StateIndex id() const { return id_; }
+        unsigned cnt_sets() const { return cnt_sets_; }
+        bool dead() const { return blob_[0] == 0 && blob_[1] == 0; }
+
+        std::span<const CA::StateId> normal() const { return {blob_ + 1, blob_[0]}; }
+        uint32_t counter_count() const { return blob_[blob_[0] + 1]; }
+        CounterStateView counter_at(uint32_t i) const {
+            return CounterStateView(blob_, blob_ + blob_[0] + 2 + 4 * i);
+        }
+        // the state must contain a counter state of the CA state
+        CounterStateView counter(CA::StateId state) const;
+
+        Trans& trans(uint8_t byte_class) { return trans_[byte_class]; }
+        Trans const& trans(uint8_t byte_class) const { return trans_[byte_class]; }
+
+        // decoded copy used to compute the transitions
+        State state() const;
+        size_t words() const { return size_; }
+        std::string to_str() const { return state().to_str(); }
+
+        private:
+        friend class StateCache;
+
+        uint32_t const* blob_;
+        Trans* trans_;
+        uint32_t size_;
+        StateIndex id_;
+        unsigned cnt_sets_;
+    };
+
+    // Interns the states of a CSA. The states get dense ids and are stored
+    // in chunks that double in size, each chunk has one contiguous table of
+    // the transitions of its states. Adding states must be done under the
+    // lock of the CSA, the added states never move. All the memory of the
+    // cache is taken from the resource of the CSA, which the cache keeps
+    // alive while configs using it or flows saved in it exist.
+    class StateCache {
         public:
-        CSA(CA::CA<uint8_t> &&ca) : ca_(std::move(ca)), states_() {}
+        StateCache(unsigned bytemap_range, std::shared_ptr<std::pmr::memory_resource> resource);
+        StateCache(StateCache const&) = delete;
+        StateCache& operator=(StateCache const&) = delete;
+        ~StateCache();
+
+        // returns the interned state, added is set if it was not there
+        CachedState* get(State const& state, bool& added);
+        CachedState* at(StateIndex id);
+        size_t size() const { return size_; }
+        UpdatePool& updates() { return updates_; }
+        // frees the transitions and their updates, the states stay
+        void clear_transitions();
+        // counts the configs with states in the cache, under the lock of
+        // the CSA, detach returns true for the last one
+        void attach() { ++configs_; }
+        bool detach() { return --configs_ == 0; }
+
+        private:
+        static constexpr unsigned first_chunk_bits = 4;
+        static constexpr size_t blob_block_words = 1 << 14;
+
+        struct Chunk {
+            CachedState* states;
+            // null after clear_transitions
+            Trans* trans;
+            size_t count;
+        };
+
+        static void encode(State const& state, std::pmr::vector<uint32_t>& out);
+        void free_transitions(Chunk& chunk);
+
+        // declared first, so it is destroyed after everything allocated
+        // from it
+        std::shared_ptr<std::pmr::memory_resource> resource_;
+        std::pmr::polymorphic_allocator<> alloc_;
+        std::pmr::vector<Chunk> chunks_;
+        BlockArena<uint32_t> blobs_;
+        // open addressing index of the states with linear probing, the
+        // slots keep the hash so that growing does not need the states
+        struct Slot {
+            uint64_t hash;
+            StateIndex id;
+        };
+        static constexpr StateIndex empty_slot = std::numeric_limits<StateIndex>::max();
+        static constexpr size_t first_index_size = 64;
+
+        void grow_index();
+
+        std::pmr::vector<Slot> index_;
+        std::pmr::vector<uint32_t> key_;
+        UpdatePool updates_;
+        unsigned bytemap_range_;
+        size_t size_;
+        unsigned configs_;
+    };
 
-        CachedState* get_state(State state);
+    // The CSA can be shared by configs running in different threads. The
+    // computed transitions are read without locking, computing a missing
+    // transition or state is done under the mutex of the CSA.
+    //
+    // With a memory budget the cache is flushed when a transition is
+    // missing and the budget is exceeded, the config that hit it continues
+    // from its current state in the new cache. The other configs keep
+    // reading the transitions of the flushed cache and move to the new one
+    // when they miss a transition. The last config to leave the flushed
+    // cache frees its transitions, its states stay while there are flows
+    // saved in it, they are moved to the new cache when resumed.
+    //
+    // The cache and the counting sets of the configs allocate from the
+    // given resource, through a pool for the cache and a pool of each
+    // config. The resource must outlive the CSA, its configs and the flows
+    // saved in it, and be thread-safe if the CSA is shared between threads.
+    class CSA {
+        public:
+        CSA(CA::CA<uint8_t> &&ca, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+            : ca_(std::move(ca)), resource_(resource),
+            cache_resource_(std::make_shared<std::pmr::synchronized_pool_resource>(resource)),
+            states_(std::make_shared<StateCache>(ca_.bytemap_range(), cache_resource_)),
+            mutex_(), memory_(0), memory_budget_(0), flushes_(0) {}
+        CSA(CSA const&) = delete;
+        CSA& operator=(CSA const&) = delete;
+
+        CachedState* get_state(State const& state);
+        Update const* get_update(UpdateEnum type, CachedState* next_state, UpdateProg const& prog);
         CA::CA<uint8_t> const& ca() const { return ca_; }
+        std::pmr::memory_resource* resource() const { return resource_; }
+        // held while a missing transition is computed, recursive because
+        // the computation calls get_state
+        std::unique_lock<std::recursive_mutex> lock() const {
+            return std::unique_lock(mutex_);
+        }
+
+        // 0 means unlimited
+        void set_memory_budget(size_t bytes) { memory_budget_ = bytes; }
+        size_t memory_budget() const { return memory_budget_; }
+        // approximate memory of the states computed since the last flush
+        size_t memory() const { return memory_.load(std::memory_order_relaxed); }
+        void charge(size_t bytes) { memory_.fetch_add(bytes, std::memory_order_relaxed); }
+        bool over_budget() const { return memory_budget_ != 0 && memory() > memory_budget_; }
+        uint64_t flushes() const { return flushes_; }
 
         // for debugging
         std::string to_str() const;
@@ -540,49 +959,277 @@ namespace CSA {
         void compute_full();
 
         private:
+        friend class SharedCache;
+        friend class Config;
+
+        // the lock must be held, the configs move to the new cache
+        // themselves
+        void flush();
+
         CA::CA<uint8_t> ca_;
-        StateCache states_;
+        std::pmr::memory_resource* resource_;
+        // shared with the caches, which can outlive the CSA
+        std::shared_ptr<std::pmr::memory_resource> cache_resource_;
+        // shared with the flows saved in it
+        std::shared_ptr<StateCache> states_;
+        mutable std::recursive_mutex mutex_;
+        std::atomic<size_t> memory_;
+        size_t memory_budget_;
+        uint64_t flushes_;
+    };
+
+    class Config;
+
+    // Position of one input stream (flow) in a CSA that is shared by many
+    // flows. It holds only the CSA state and the compactly encoded counting
+    // sets, the config used to scan the flow is shared.
+    class FlowState {
+        public:
+        FlowState() : state_(nullptr), cnt_sets_(), cache_(), position_(0) {}
+        FlowState(FlowState const&) = default;
+        FlowState(FlowState&&) = default;
+        FlowState& operator=(FlowState const&) = default;
+        FlowState& operator=(FlowState&&) = default;
+
+        // flow that was not saved yet starts in the initial state
+        bool started() const { return state_ != nullptr; }
+        // bytes of the flow scanned when it was saved by a matcher
+        uint64_t position() const { return position_; }
+        // includes the heap memory of the encoded counting sets
+        size_t memory() const {
+            // beyond the capacity of an empty string the contents are on the heap
+            bool on_heap = cnt_sets_.capacity() > std::string().capacity();
+            return sizeof(FlowState) + (on_heap ? cnt_sets_.capacity() + 1 : 0);
+        }
+
+        private:
+        friend class Config;
+        friend class Matcher;
+
+        CachedState* state_;
+        std::string cnt_sets_;
+        // keeps state_ alive when the cache of the CSA is flushed
+        std::shared_ptr<StateCache const> cache_;
+        uint64_t position_;
+    };
+
+    // Keeps the freed small blocks in free lists of their size for reuse,
+    // the counting sets of a config allocate and free list nodes all the
+    // time. Not thread-safe, each config has its own.
+    class RecyclingResource : public std::pmr::memory_resource {
+        public:
+        RecyclingResource(std::pmr::memory_resource* upstream) : upstream_(upstream), free_() {}
+        RecyclingResource(RecyclingResource const&) = delete;
+        RecyclingResource& operator=(RecyclingResource const&) = delete;
+        ~RecyclingResource();
+
+        private:
+        static constexpr size_t granularity = alignof(std::max_align_t);
+        static constexpr size_t size_classes = 4;
+
+        struct Block { Block* next; };
+
+        static size_t size_class(size_t bytes, size_t alignment) {
+            return alignment <= granularity ? (bytes + granularity - 1) / granularity : 0;
+        }
+
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+            return this == &other;
+        }
+
+        std::pmr::memory_resource* upstream_;
+        // blocks of (i + 1) * granularity bytes
+        std::array<Block*, size_classes> free_;
+    };
+
+    // Bump allocator for the temporaries of computing a transition. Freeing
+    // does nothing, reset() hands the blocks out again from the first one,
+    // so after a few transitions the builders do not reach the upstream.
+    class ScratchResource : public std::pmr::memory_resource {
+        public:
+        ScratchResource(std::pmr::memory_resource* upstream)
+            : upstream_(upstream), blocks_(upstream), block_(0), used_(0) {}
+        ScratchResource(ScratchResource const&) = delete;
+        ScratchResource& operator=(ScratchResource const&) = delete;
+        ~ScratchResource();
+
+        // nothing allocated before may be used after
+        void reset() { block_ = 0; used_ = 0; }
+
+        private:
+        static constexpr size_t first_block_size = 1 << 12;
+
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void*, size_t, size_t) override {}
+        bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+            return this == &other;
+        }
+
+        std::pmr::memory_resource* upstream_;
+        // blocks with their size and alignment, each twice the previous
+        struct Block { std::byte* data; size_t size; size_t alignment; };
+        std::pmr::vector<Block> blocks_;
+        size_t block_;
+        size_t used_;
     };
 
     class Config {
         public:
-        Config(CA::CA<uint8_t> &&ca)
-            : csa_(std::move(ca)), cur_state_(csa_.get_state(InitialState)), 
-            init_state_(cur_state_), cnt_sets_(), cnt_sets_tmp_() {}
+        Config(CSA &csa);
+        ~Config();
         Config(Config&&) = delete;
         Config(Config&) = delete;
         Config& operator=(Config&) = delete;
         Config& operator=(Config&&) = delete;
 
         void reset() { cur_state_ = init_state_; cnt_sets_.resize(0); }
+        // resets the config to search from a position inside the text
+        void restart() { cur_state_ = restart_state_; cnt_sets_.resize(0); }
         bool step(uint8_t c); // true if there is still chance to match
-        bool accepting();
+        // inside the text the states final only at its end do not count
+        bool accepting(bool text_end = true);
+        // appends the CA states that make the config accepting
+        void accepting_states(std::vector<CA::StateId>& states);
+        bool dead() const { return cur_state_->dead(); }
+
+        CachedState const* cur_state() const { return cur_state_; }
+        CntSetVec const& cnt_sets() const { return cnt_sets_; }
+        // the state can come from a config of another CSA of the same CA
+        void load(State const& state, CntSetVec const& cnt_sets);
+
+        // the flow state must have been saved by a config of the same CSA
+        void save(FlowState& flow) const;
+        void resume(FlowState const& flow);
 
         std::string csa_to_DOT() const;
 
         private:
-        bool eval_guard(CA::Guard guard, CounterState const& cnt_state);
+        // the lock of the CSA must be held by all of these
+        void attach_cache();
+        void detach_cache();
+        // moves the config to the current cache of the CSA if it was flushed
+        void sync_cache();
+        void flush_cache();
+        bool eval_guard(CA::Guard guard, CounterStateView cnt_state);
         void execute_update(Update const& update);
         uint64_t compute_update_index(GuardVec const& guards);
         void compute_trans(Trans& trans, uint8_t byte_class);
-        Update const& get_lazy_update(LazyTrans& lazy);
+        Update const& get_lazy_update(LazyTrans& lazy, uint8_t byte_class);
 
         std::string cnt_sets_to_str() const;
 
-        CSA csa_;
+        CSA& csa_;
+        // the cache of the states below, can be an already flushed one
+        std::shared_ptr<StateCache> cache_;
         CachedState* cur_state_;
         CachedState* init_state_;
+        CachedState* restart_state_;
+        RecyclingResource cnt_resource_;
         CntSetVec cnt_sets_;
         CntSetVec cnt_sets_tmp_;
+        // temporaries of the builders, reset for each computed transition
+        ScratchResource builder_resource_;
+    };
+
+    // span [start, end) of a match in the searched buffer
+    struct MatchSpan {
+        size_t start;
+        size_t end;
+
+        bool operator==(MatchSpan const& other) const = default;
+    };
+
+    class Matcher;
+
+    // iterates over the successive non-overlapping matches in a buffer,
+    // default constructed iterator is the end iterator
+    class MatchIterator {
+        public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = MatchSpan;
+        using difference_type = std::ptrdiff_t;
+        using pointer = MatchSpan const*;
+        using reference = MatchSpan const&;
+
+        MatchIterator() : matcher_(nullptr), text_(), span_() {}
+        MatchIterator(Matcher& matcher, std::string_view text);
+
+        MatchSpan const& operator*() const { return span_; }
+        MatchSpan const* operator->() const { return &span_; }
+        MatchIterator& operator++();
+        MatchIterator operator++(int) { auto tmp = *this; ++*this; return tmp; }
+
+        bool operator==(MatchIterator const& other) const {
+            return matcher_ == other.matcher_ && (matcher_ == nullptr || span_ == other.span_);
+        }
+
+        private:
+        void advance(size_t pos);
+
+        Matcher* matcher_;
+        std::string_view text_;
+        MatchSpan span_;
+    };
+
+    class MatchRange {
+        public:
+        MatchRange(Matcher& matcher, std::string_view text) : matcher_(matcher), text_(text) {}
+
+        MatchIterator begin() { return MatchIterator(matcher_, text_); }
+        MatchIterator end() { return MatchIterator(); }
+
+        private:
+        Matcher& matcher_;
+        std::string_view text_;
     };
 
     class Matcher {
         public:
-        Matcher(std::string_view pattern);
+        Matcher(std::string_view pattern,
+                std::pmr::memory_resource* resource = std::pmr::get_default_resource());
         bool match(std::string_view text);
 
+        // Matches are searched from pos, the CSA is restarted after each
+        // match. The anchors are relative to the whole text, a start anchor
+        // matches only at 0 and an end anchor only at text.size(). A match
+        // ends at the earliest position where the config accepts and starts
+        // at the latest position that still gives a match ending there.
+        std::optional<MatchSpan> find(std::string_view text, size_t pos = 0);
+        MatchRange matches(std::string_view text) { return MatchRange(*this, text); }
+        // counts the non-overlapping matches, cheaper than iterating
+        // because the starts of the matches are not computed
+        size_t count(std::string_view text);
+
+        Config& config() { return config_; }
+        CSA& csa() { return csa_; }
+
+        // Streaming interface, the state of the config persists between the
+        // chunks so the input does not have to be in memory at once.
+        void begin();
+        // returns false when the input can not match anymore
+        bool feed(std::string_view chunk);
+        // result of the match of all fed chunks, the config is reset
+        bool finish();
+        // number of bytes fed since begin(), a resumed flow continues its count
+        uint64_t position() const { return position_; }
+
+        // Switching between flows scanned by the streaming interface, one
+        // matcher (CSA and config) is shared by all the flows.
+        void save(FlowState& flow) const;
+        void resume(FlowState const& flow);
+
         private:
+        std::optional<size_t> find_end(std::string_view text, size_t pos);
+        // whether text[start, end) contains a match, the anchors are
+        // relative to text
+        bool match_within(std::string_view text, size_t start, size_t end);
+
+        CSA csa_;
         Config config_;
+        bool alive_;
+        uint64_t position_;
     };
 
     class Visualizer {
@@ -1,7 +1,38 @@
 #include "csa.hh"
+#include "csa_cache.hh"
+#include "glushkov.hh"
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <iostream>
 
+namespace {
+    // shared by csa_match and csa_compile_cached
+    CSA::MatcherCache& matcher_cache() {
+        static CSA::MatcherCache cache(256);
+        return cache;
+    }
+
+    using CachedHandle = std::shared_ptr<CSA::MatcherCache::Entry>;
+
+    // Compiled pattern shared by threads, the lazily computed states of
+    // the CSA are shared by all scratches of the program.
+    struct Program {
+        Program(const char* pattern) : csa(CA::glushkov::Builder::get_ca(pattern)) {}
+
+        CSA::CSA csa;
+    };
+
+    // Per thread state of a scan: the current CSA state and counting sets.
+    struct Scratch {
+        Scratch(Program& program) : program(program), config(program.csa) {}
+
+        Program& program;
+        CSA::Config config;
+    };
+}
+
 extern "C" {
     void* csa_compile(const char* pattern) {
         try {
@@ -27,10 +58,141 @@ extern "C" {
         }
     }
 
+    // 0 means unlimited, the state cache is flushed when it grows over
+    void csa_set_memory_budget(void* ptr, size_t bytes) {
+        if (ptr) {
+            static_cast<CSA::Matcher*>(ptr)->csa().set_memory_budget(bytes);
+        }
+    }
+
+    long csa_flushes(void* ptr) {
+        if (!ptr) return -1;
+        return static_cast<long>(static_cast<CSA::Matcher*>(ptr)->csa().flushes());
+    }
+
+    long csa_count_compiled(void* ptr, const char* text) {
+        if (!ptr) return -1;
+        try {
+            CSA::Matcher* matcher = static_cast<CSA::Matcher*>(ptr);
+            return static_cast<long>(matcher->count(text));
+        } catch (...) {
+            return -1;
+        }
+    }
+
+    // returns a handle to the cached matcher of the pattern, the handle
+    // keeps the matcher alive after eviction until csa_release_cached
+    void* csa_compile_cached(const char* pattern) {
+        try {
+            return new CachedHandle(matcher_cache().get(pattern));
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    void csa_release_cached(void* handle) {
+        if (handle) {
+            delete static_cast<CachedHandle*>(handle);
+        }
+    }
+
+    int csa_match_cached(void* handle, const char* text) {
+        if (!handle) return -1;
+        try {
+            auto& entry = **static_cast<CachedHandle*>(handle);
+            std::lock_guard lock(entry.mutex);
+            return entry.matcher.match(text) ? 1 : 0;
+        } catch (...) {
+            return -1;
+        }
+    }
+
+    void csa_cache_stats(uint64_t* hits, uint64_t* misses, uint64_t* evictions) {
+        auto stats = matcher_cache().stats();
+        if (hits) *hits = stats.hits;
+        if (misses) *misses = stats.misses;
+        if (evictions) *evictions = stats.evictions;
+    }
+
+    void csa_cache_set_capacity(size_t capacity) {
+        matcher_cache().set_capacity(capacity);
+    }
+
+    void csa_cache_clear() {
+        matcher_cache().clear();
+    }
+
+    void* csa_program_compile(const char* pattern) {
+        try {
+            return new Program(pattern);
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    // all scratches of the program must be freed first
+    void csa_program_free(void* program) {
+        if (program) {
+            delete static_cast<Program*>(program);
+        }
+    }
+
+    // 0 means unlimited, the state cache shared by the scratches is flushed
+    // when it grows over
+    void csa_program_set_memory_budget(void* program, size_t bytes) {
+        if (program) {
+            static_cast<Program*>(program)->csa.set_memory_budget(bytes);
+        }
+    }
+
+    long csa_program_flushes(void* program) {
+        if (!program) return -1;
+        auto& csa = static_cast<Program*>(program)->csa;
+        auto lock = csa.lock();
+        return static_cast<long>(csa.flushes());
+    }
+
+    void* csa_scratch_alloc(void* program) {
+        if (!program) return nullptr;
+        try {
+            return new Scratch(*static_cast<Program*>(program));
+        } catch (...) {
+            return nullptr;
+        }
+    }
+
+    void csa_scratch_free(void* scratch) {
+        if (scratch) {
+            delete static_cast<Scratch*>(scratch);
+        }
+    }
+
+    // returns 1 if data contains a match, the scratch must be allocated for
+    // the program and used by one thread at a time
+    int csa_scan(void* program, void* scratch, const char* data, size_t len) {
+        if (!program || !scratch) return -1;
+        auto& prog = *static_cast<Program*>(program);
+        auto& scr = *static_cast<Scratch*>(scratch);
+        if (&scr.program != &prog) return -1;
+        try {
+            auto& config = scr.config;
+            config.reset();
+            for (size_t i = 0; i < len; ++i) {
+                if (!config.step(static_cast<uint8_t>(data[i]))) {
+                    return 0;
+                }
+            }
+            return config.accepting() ? 1 : 0;
+        } catch (...) {
+            return -1;
+        }
+    }
+
     int csa_match(const char* pattern, const char* text) {
         try {
-            CSA::Matcher matcher(pattern);
-            return matcher.match(text) ? 1 : 0;
+            auto entry = matcher_cache().get(pattern);
+            std::lock_guard lock(entry->mutex);
+            return entry->matcher.match(text) ? 1 : 0;
         } catch (const std::exception& e) {
             std::cerr << "Regex error: " << e.what() << std::endl;
             return -1; // Indicate error
@@ -0,0 +1,72 @@
+#include "csa_cache.hh"
+
+namespace CSA {
+
+std::shared_ptr<MatcherCache::Entry> MatcherCache::get(std::string const& pattern) {
+    {
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(pattern);
+        if (it != entries_.end()) {
+            ++stats_.hits;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->second;
+        }
+        ++stats_.misses;
+    }
+
+    // compiled without the lock so that a slow pattern does not block the
+    // lookups of the others, errors propagate to the caller
+    auto entry = std::make_shared<Entry>(pattern);
+
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(pattern);
+    if (it != entries_.end()) {
+        // compiled concurrently by another caller, keep the first one
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+    if (capacity_ == 0) {
+        return entry;
+    }
+    lru_.emplace_front(pattern, entry);
+    entries_.emplace(pattern, lru_.begin());
+    evict_over_capacity();
+    return entry;
+}
+
+void MatcherCache::set_capacity(size_t capacity) {
+    std::lock_guard lock(mutex_);
+    capacity_ = capacity;
+    evict_over_capacity();
+}
+
+size_t MatcherCache::capacity() const {
+    std::lock_guard lock(mutex_);
+    return capacity_;
+}
+
+size_t MatcherCache::size() const {
+    std::lock_guard lock(mutex_);
+    return lru_.size();
+}
+
+MatcherCache::Stats MatcherCache::stats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void MatcherCache::clear() {
+    std::lock_guard lock(mutex_);
+    entries_.clear();
+    lru_.clear();
+}
+
+void MatcherCache::evict_over_capacity() {
+    while (lru_.size() > capacity_) {
+        entries_.erase(lru_.back().first);
+        lru_.pop_back();
+        ++stats_.evictions;
+    }
+}
+
+} // namespace CSA
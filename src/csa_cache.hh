@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "csa.hh"
+
+namespace CSA {
+
+    // Bounded LRU cache of compiled matchers keyed by the pattern. Keeping
+    // the matcher keeps the lazily computed states of its CSA, so repeated
+    // calls with the same pattern do not start from an empty cache.
+    class MatcherCache {
+        public:
+        // the matcher is not thread safe, users of an entry lock its mutex
+        struct Entry {
+            Entry(std::string const& pattern) : mutex(), matcher(pattern) {}
+
+            std::mutex mutex;
+            Matcher matcher;
+        };
+
+        struct Stats {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+        };
+
+        MatcherCache(size_t capacity) : mutex_(), capacity_(capacity), lru_(), entries_(), stats_() {}
+        MatcherCache(MatcherCache const&) = delete;
+        MatcherCache& operator=(MatcherCache const&) = delete;
+
+        // returns the cached matcher of the pattern, compiles it on a miss,
+        // evicted entries stay alive while somebody holds them
+        std::shared_ptr<Entry> get(std::string const& pattern);
+
+        void set_capacity(size_t capacity);
+        size_t capacity() const;
+        size_t size() const;
+        Stats stats() const;
+        void clear();
+
+        private:
+        using LruList = std::list<std::pair<std::string, std::shared_ptr<Entry>>>;
+
+        void evict_over_capacity();
+
+        mutable std::mutex mutex_;
+        size_t capacity_;
+        // most recently used first
+        LruList lru_;
+        std::unordered_map<std::string, LruList::iterator> entries_;
+        Stats stats_;
+    };
+
+} // namespace CSA
@@ -0,0 +1,55 @@
+#include "csa_compile.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+
+namespace CSA {
+
+std::vector<CompileResult> compile_patterns(std::vector<std::string> const& patterns,
+        unsigned threads) {
+    std::vector<CompileResult> results(patterns.size());
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threads = std::min<size_t>(threads, std::max<size_t>(patterns.size(), 1));
+
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i = next++; i < patterns.size(); i = next++) {
+            auto& res = results[i];
+            try {
+                res.matcher = std::make_unique<Matcher>(patterns[i]);
+            } catch (Error const& err) {
+                res.error = err.what();
+                res.code = err.code();
+            } catch (std::exception const& err) {
+                res.error = err.what();
+                res.code = Errors::InternalFailure;
+            } catch (...) {
+                // nothing may escape the threads of the pool
+                res.error = "unknown exception";
+                res.code = Errors::InternalFailure;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    try {
+        pool.reserve(threads - 1);
+        for (unsigned i = 1; i < threads; ++i) {
+            pool.emplace_back(work);
+        }
+    } catch (std::exception const&) {
+        // out of threads, this thread and the ones already started take
+        // all the patterns and are joined below
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    return results;
+}
+
+} // namespace CSA
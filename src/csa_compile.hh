@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "csa.hh"
+#include "csa_errors.hh"
+
+namespace CSA {
+
+    // result of compiling one pattern of a batch, matcher is null when
+    // the compilation failed, error and code are only set then
+    struct CompileResult {
+        CompileResult() : matcher(), error(), code(Errors::InternalFailure) {}
+
+        std::unique_ptr<Matcher> matcher;
+        std::string error;
+        Errors code;
+
+        bool ok() const { return matcher != nullptr; }
+    };
+
+    // Parses the patterns and builds their CAs on a pool of threads, the
+    // errors are reported per pattern. threads == 0 uses one thread per core.
+    std::vector<CompileResult> compile_patterns(std::vector<std::string> const& patterns,
+            unsigned threads = 0);
+
+} // namespace CSA
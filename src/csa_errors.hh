@@ -1,10 +1,15 @@
 #pragma once
-#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 
+// throws CSA::Error so that callers compiling many patterns can report
+// the failure per pattern, ca_cli exits with the error code
 #define FATAL_ERROR(msg, err) do {\
-    std::cerr << "Error:" << __FILE__ << ":" << __LINE__ << ": " << __func__ << ": " \
-        << msg << std::endl; \
-    exit(static_cast<int>(err));} while(false)
+    std::ostringstream fatal_error_msg_; \
+    fatal_error_msg_ << "Error:" << __FILE__ << ":" << __LINE__ << ": " << __func__ << ": " \
+        << msg; \
+    throw ::CSA::Error(fatal_error_msg_.str(), err);} while(false)
 
 
 namespace CSA {
@@ -17,6 +22,17 @@ namespace CSA {
         InvalidUtf8 = 14,
         FailedToParse = 15,
         WeirdAnchor = 16,
+        SharedMemory = 17,
+    };
+
+    class Error : public std::runtime_error {
+        public:
+        Error(std::string const& msg, Errors code) : std::runtime_error(msg), code_(code) {}
+
+        Errors code() const { return code_; }
+
+        private:
+        Errors code_;
     };
 
 } // namespace CSA
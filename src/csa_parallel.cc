@@ -0,0 +1,184 @@
+#include "csa_parallel.hh"
+#include "glushkov.hh"
+
+#include <algorithm>
+#include <thread>
+
+namespace CSA {
+
+ParallelMatcher::ParallelMatcher(std::string_view pattern, unsigned threads)
+    : csa_(CA::glushkov::Builder::get_ca(pattern)), workers_(), sync_state_(), reruns_(0),
+    min_chunk_size_(1 << 16), mutex_(), start_(), done_(), generation_(0), running_(0),
+    stopping_(false), threads_() {
+    auto any_loop_start = csa_.ca().any_loop_start();
+    if (any_loop_start != CA::InitState) {
+        sync_state_.emplace(NormalStateVec{any_loop_start, }, CounterStateMap{}, 0);
+    }
+    for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+        workers_.push_back(std::make_unique<Worker>(csa_));
+    }
+    // anchored patterns are always matched sequentially
+    if (sync_state_) {
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            threads_.emplace_back([this, i] { serve(i); });
+        }
+    }
+}
+
+ParallelMatcher::~ParallelMatcher() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    start_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void ParallelMatcher::serve(size_t i) {
+    auto& worker = *workers_[i];
+    uint64_t served = 0;
+    std::unique_lock lock(mutex_);
+    while (true) {
+        start_.wait(lock, [&] { return stopping_ || generation_ != served; });
+        if (stopping_) {
+            return;
+        }
+        served = generation_;
+        lock.unlock();
+        worker.exception = nullptr;
+        try {
+            worker.config.load(*sync_state_, {});
+            // the speculative run contains the any_loop_start state so it can not die
+            worker.run(worker.chunk);
+        } catch (...) {
+            worker.exception = std::current_exception();
+        }
+        lock.lock();
+        if (--running_ == 0) {
+            done_.notify_one();
+        }
+    }
+}
+
+void ParallelMatcher::wait_for_workers() {
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [&] { return running_ == 0; });
+}
+
+bool ParallelMatcher::Worker::run(std::string_view chunk) {
+    end_state.reset();
+    for (char c : chunk) {
+        if (!config.step(c)) {
+            return false;
+        }
+    }
+    end_state.emplace(config.cur_state()->state());
+    end_cnt_sets = config.cnt_sets();
+    return true;
+}
+
+bool ParallelMatcher::match_sequential(std::string_view text) {
+    auto& config = workers_[0]->config;
+    config.reset();
+    for (char c : text) {
+        if (!config.step(c)) {
+            config.reset();
+            return false;
+        }
+    }
+    bool res = config.accepting();
+    config.reset();
+    return res;
+}
+
+bool ParallelMatcher::match(std::string_view text) {
+    reruns_ = 0;
+    size_t chunks = workers_.size();
+    // anchored patterns have nothing to synchronise on
+    if (!sync_state_ || chunks == 1 || text.size() / chunks < min_chunk_size_) {
+        return match_sequential(text);
+    }
+
+    size_t chunk_size = text.size() / chunks;
+    auto chunk = [&](size_t i) {
+        size_t begin = i * chunk_size;
+        return text.substr(begin, i + 1 == chunks ? text.npos : chunk_size);
+    };
+
+    for (size_t i = 1; i < chunks; ++i) {
+        workers_[i]->chunk = chunk(i);
+    }
+    {
+        std::lock_guard lock(mutex_);
+        running_ = chunks - 1;
+        ++generation_;
+    }
+    start_.notify_all();
+
+    auto& main = *workers_[0];
+    main.config.reset();
+    bool alive = true;
+    try {
+        for (char c : chunk(0)) {
+            if (!main.config.step(c)) {
+                alive = false;
+                break;
+            }
+        }
+    } catch (...) {
+        wait_for_workers();
+        throw;
+    }
+    wait_for_workers();
+    for (size_t i = 1; i < chunks; ++i) {
+        if (workers_[i]->exception) {
+            std::rethrow_exception(workers_[i]->exception);
+        }
+    }
+
+    // the states are compared by address, which changes when the cache of
+    // the CSA is flushed
+    uint64_t flushes = csa_.flushes();
+    CachedState* sync = csa_.get_state(*sync_state_);
+    auto at_sync = [&] {
+        if (csa_.flushes() != flushes) {
+            flushes = csa_.flushes();
+            sync = csa_.get_state(*sync_state_);
+        }
+        return main.config.cur_state() == sync;
+    };
+    for (size_t i = 1; i < chunks && alive; ++i) {
+        auto& worker = *workers_[i];
+        bool synced = at_sync();
+        if (!synced) {
+            ++reruns_;
+            for (char c : chunk(i)) {
+                if (!main.config.step(c)) {
+                    alive = false;
+                    break;
+                }
+                if (at_sync()) {
+                    synced = true;
+                    break;
+                }
+            }
+        }
+        if (synced) {
+            if (!worker.end_state) {
+                alive = false;
+                break;
+            }
+            main.config.load(*worker.end_state, worker.end_cnt_sets);
+        }
+    }
+
+    bool res = alive && main.config.accepting();
+    for (auto& worker : workers_) {
+        worker->config.reset();
+    }
+    return res;
+}
+
+} // namespace CSA
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "csa.hh"
+
+namespace CSA {
+
+    // Matches one large input on multiple threads. The input is split into
+    // chunks, the first one is run from the initial state and the others
+    // speculatively from the state containing only the any_loop_start state
+    // of the unanchored pattern. The results are stitched in order, a chunk
+    // is re-run from its real start state only when the speculation was
+    // wrong and only until the real run reaches the speculative start state
+    // again, from there both runs are identical. All threads share one CSA,
+    // so the states computed by one thread are reused by the others. The
+    // threads are started with the matcher and wait for the chunks of the
+    // following matches.
+    class ParallelMatcher {
+        public:
+        ParallelMatcher(std::string_view pattern, unsigned threads);
+        ParallelMatcher(ParallelMatcher const&) = delete;
+        ParallelMatcher& operator=(ParallelMatcher const&) = delete;
+        ~ParallelMatcher();
+
+        bool match(std::string_view text);
+
+        // number of chunks that had to be re-run in the last match
+        unsigned reruns() const { return reruns_; }
+        // smaller inputs are matched sequentially
+        void set_min_chunk_size(size_t size) { min_chunk_size_ = size; }
+        // the CSA shared by the threads, e.g. to set its memory budget
+        CSA& csa() { return csa_; }
+
+        private:
+        struct Worker {
+            Worker(CSA& csa) : config(csa), chunk(), end_state(), end_cnt_sets(), exception() {}
+
+            bool run(std::string_view chunk);
+
+            Config config;
+            // speculatively run by the thread of the worker
+            std::string_view chunk;
+            std::optional<State> end_state;
+            CntSetVec end_cnt_sets;
+            std::exception_ptr exception;
+        };
+
+        bool match_sequential(std::string_view text);
+        // loop of the thread of the i-th worker
+        void serve(size_t i);
+        void wait_for_workers();
+
+        CSA csa_;
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::optional<State> sync_state_;
+        unsigned reruns_;
+        size_t min_chunk_size_;
+
+        std::mutex mutex_;
+        std::condition_variable start_;
+        std::condition_variable done_;
+        // incremented when the workers get new chunks
+        uint64_t generation_;
+        // workers that did not finish their chunks yet
+        size_t running_;
+        bool stopping_;
+        std::vector<std::thread> threads_;
+    };
+
+} // namespace CSA
@@ -0,0 +1,365 @@
+#include "csa_server.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "csa_stream.hh"
+#include "glushkov.hh"
+
+namespace CSA {
+
+namespace {
+
+    bool read_all(int fd, char* data, size_t size) {
+        while (size > 0) {
+            ssize_t res = read(fd, data, size);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                return false;
+            }
+            data += res;
+            size -= res;
+        }
+        return true;
+    }
+
+    bool write_all(int fd, char const* data, size_t size) {
+        while (size > 0) {
+            ssize_t res = send(fd, data, size, MSG_NOSIGNAL);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                return false;
+            }
+            data += res;
+            size -= res;
+        }
+        return true;
+    }
+
+    // reads and drops the body of a request that can not be handled
+    bool skip(int fd, size_t size) {
+        char buf[1 << 12];
+        while (size > 0) {
+            size_t len = std::min(size, sizeof(buf));
+            if (!read_all(fd, buf, len)) {
+                return false;
+            }
+            size -= len;
+        }
+        return true;
+    }
+
+    uint32_t load_u32(char const* data) {
+        uint32_t val = 0;
+        for (int i = 3; i >= 0; --i) {
+            val = (val << 8) | static_cast<uint8_t>(data[i]);
+        }
+        return val;
+    }
+
+    void append_u32(std::string& out, uint32_t val) {
+        for (int i = 0; i < 4; ++i) {
+            out.push_back(static_cast<char>(val >> (8 * i)));
+        }
+    }
+
+    void append_u64(std::string& out, uint64_t val) {
+        for (int i = 0; i < 8; ++i) {
+            out.push_back(static_cast<char>(val >> (8 * i)));
+        }
+    }
+
+    // reads the body of Match and Count requests
+    class BufferReader {
+        public:
+        BufferReader(std::string_view body) : body_(body), pos_(0) {}
+
+        bool u32(uint32_t& val) {
+            if (body_.size() - pos_ < 4) {
+                return false;
+            }
+            val = load_u32(body_.data() + pos_);
+            pos_ += 4;
+            return true;
+        }
+
+        bool buffer(std::string_view& buf) {
+            uint32_t len;
+            if (!u32(len) || body_.size() - pos_ < len) {
+                return false;
+            }
+            buf = body_.substr(pos_, len);
+            pos_ += len;
+            return true;
+        }
+
+        bool done() const { return pos_ == body_.size(); }
+
+        private:
+        std::string_view body_;
+        size_t pos_;
+    };
+
+    bool contains_match(Config& config, std::string_view buf) {
+        config.reset();
+        for (char c : buf) {
+            if (!config.step(c)) {
+                config.reset();
+                return false;
+            }
+        }
+        bool res = config.accepting();
+        config.reset();
+        return res;
+    }
+
+    uint64_t count_matches(Config& config, std::string_view buf) {
+        auto stream = stream_matches(config);
+        stream.feed(buf);
+        stream.close();
+        uint64_t matches = 0;
+        while (stream.next()) {
+            ++matches;
+        }
+        return matches;
+    }
+
+} // anonymous namespace
+
+Server::Program::Program(std::string const& pattern, size_t memory_budget)
+    : pattern(pattern), csa(CA::glushkov::Builder::get_ca(pattern)), last_use(0) {
+    csa.set_memory_budget(memory_budget);
+}
+
+Server::Server(std::string socket_path, size_t max_programs, size_t memory_budget)
+    : socket_path_(std::move(socket_path)), listen_fd_(-1), stopped_(false), programs_mutex_(),
+    programs_(), program_ids_(), next_id_(0), use_stamp_(0), max_programs_(std::max<size_t>(max_programs, 1)),
+    memory_budget_(memory_budget), connections_mutex_(), connections_(), idle_() {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(addr.sun_path)) {
+        FATAL_ERROR("socket path too long: " << socket_path_, Errors::UnsupportedOperation);
+    }
+    std::memcpy(addr.sun_path, socket_path_.c_str(), socket_path_.size() + 1);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+        FATAL_ERROR("failed to create socket: " << strerror(errno), Errors::InternalFailure);
+    }
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+            || listen(listen_fd_, 64) != 0) {
+        int err = errno;
+        close(listen_fd_);
+        FATAL_ERROR("failed to listen on " << socket_path_ << ": " << strerror(err),
+                Errors::InternalFailure);
+    }
+}
+
+Server::~Server() {
+    stop();
+    // the threads of the connections use the server until they finish
+    std::unique_lock lock(connections_mutex_);
+    idle_.wait(lock, [&] { return connections_.empty(); });
+    lock.unlock();
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+}
+
+void Server::run() {
+    while (!stopped_) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        std::lock_guard lock(connections_mutex_);
+        if (stopped_) {
+            close(fd);
+            break;
+        }
+        connections_.insert(fd);
+        try {
+            std::thread([this, fd] { serve(fd); }).detach();
+        } catch (std::exception const&) {
+            // out of threads, the client sees the connection closed
+            connections_.erase(fd);
+            close(fd);
+        }
+    }
+    std::unique_lock lock(connections_mutex_);
+    idle_.wait(lock, [&] { return connections_.empty(); });
+}
+
+void Server::stop() {
+    std::lock_guard lock(connections_mutex_);
+    if (stopped_.exchange(true)) {
+        return;
+    }
+    // wakes up accept and the reads of the connections
+    shutdown(listen_fd_, SHUT_RDWR);
+    for (int fd : connections_) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+size_t Server::program_count() {
+    std::lock_guard lock(programs_mutex_);
+    return programs_.size();
+}
+
+unsigned Server::compile(std::string const& pattern) {
+    {
+        std::lock_guard lock(programs_mutex_);
+        auto it = program_ids_.find(pattern);
+        if (it != program_ids_.end()) {
+            programs_[it->second]->last_use = ++use_stamp_;
+            return it->second;
+        }
+    }
+    // compiled without the lock, errors are reported to the client
+    auto program = std::make_shared<Program>(pattern, memory_budget_);
+    std::lock_guard lock(programs_mutex_);
+    auto [it, inserted] = program_ids_.emplace(pattern, next_id_);
+    if (inserted) {
+        if (programs_.size() >= max_programs_) {
+            auto lru = std::min_element(programs_.begin(), programs_.end(), [] (auto const& a, auto const& b) {
+                return a.second->last_use < b.second->last_use;
+            });
+            program_ids_.erase(lru->second->pattern);
+            programs_.erase(lru);
+        }
+        programs_.emplace(next_id_++, std::move(program));
+    }
+    programs_[it->second]->last_use = ++use_stamp_;
+    return it->second;
+}
+
+std::shared_ptr<Server::Program> Server::program(unsigned id) {
+    std::lock_guard lock(programs_mutex_);
+    auto it = programs_.find(id);
+    if (it == programs_.end()) {
+        return nullptr;
+    }
+    it->second->last_use = ++use_stamp_;
+    return it->second;
+}
+
+void Server::serve(int fd) {
+    // configs of the programs used by this connection
+    Sessions sessions;
+    std::string request;
+    std::string reply;
+    char size_buf[4];
+    while (read_all(fd, size_buf, 4)) {
+        uint32_t size = load_u32(size_buf);
+        if (size == 0 || size > max_frame_size) {
+            break;
+        }
+        reply.assign(5, '\0');
+        uint8_t status;
+        try {
+            request.resize(size);
+            if (!read_all(fd, request.data(), size)) {
+                break;
+            }
+            status = handle(request, sessions, reply);
+        } catch (Error const& err) {
+            reply.resize(5);
+            reply += err.what();
+            status = static_cast<uint8_t>(err.code());
+        } catch (std::exception const& err) {
+            // the body was not read if the request did not fit in memory
+            if (request.size() != size && !skip(fd, size)) {
+                break;
+            }
+            reply.resize(5);
+            reply += err.what();
+            status = static_cast<uint8_t>(Errors::InternalFailure);
+        }
+        std::string header;
+        append_u32(header, reply.size() - 4);
+        header.push_back(static_cast<char>(status));
+        reply.replace(0, 5, header);
+        if (!write_all(fd, reply.data(), reply.size())) {
+            break;
+        }
+    }
+    // the configs go before the server can be destroyed
+    sessions.clear();
+    std::lock_guard lock(connections_mutex_);
+    connections_.erase(fd);
+    close(fd);
+    if (connections_.empty()) {
+        idle_.notify_all();
+    }
+}
+
+uint8_t Server::handle(std::string_view request, Sessions& sessions, std::string& out) {
+    auto op = static_cast<Op>(request[0]);
+    std::string_view body = request.substr(1);
+    if (op == Op::Compile) {
+        append_u32(out, compile(std::string(body)));
+        return 0;
+    }
+    if (op != Op::Match && op != Op::Count) {
+        out += "unknown operation";
+        return bad_request;
+    }
+
+    BufferReader in(body);
+    uint32_t id;
+    uint32_t n;
+    if (!in.u32(id) || !in.u32(n)) {
+        out += "unknown pattern id";
+        return bad_request;
+    }
+    auto prog = program(id);
+    if (!prog) {
+        // the program was evicted
+        sessions.erase(id);
+        out += "unknown pattern id";
+        return bad_request;
+    }
+    auto& session = sessions[id];
+    if (!session.config) {
+        session.program = std::move(prog);
+        session.config = std::make_unique<Config>(session.program->csa);
+    }
+    auto& config = session.config;
+    append_u32(out, n);
+    for (uint32_t i = 0; i < n; ++i) {
+        std::string_view buf;
+        if (!in.buffer(buf)) {
+            out.resize(5);
+            out += "truncated buffer";
+            return bad_request;
+        }
+        if (op == Op::Match) {
+            out.push_back(contains_match(*config, buf) ? 1 : 0);
+        } else {
+            append_u64(out, count_matches(*config, buf));
+        }
+    }
+    if (!in.done()) {
+        out.resize(5);
+        out += "trailing data";
+        return bad_request;
+    }
+    return 0;
+}
+
+} // namespace CSA
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "csa.hh"
+
+namespace CSA {
+
+    // Matcher service on a Unix domain socket. The compiled patterns and
+    // their lazily computed CSAs stay resident between requests, the CSA
+    // of a pattern is shared by all connections, each connection has its
+    // own configs. At most max_programs patterns stay resident, compiling
+    // another one evicts the least recently used, whose id is then unknown
+    // to the later requests (connections using it keep it until they
+    // close). The memory budget is set on the CSA of every pattern, 0 means
+    // unlimited.
+    //
+    // Framed binary protocol, integers are little-endian:
+    //   request: u32 size, u8 op, body (size counts op and body)
+    //   reply:   u32 size, u8 status, body (status 0 is ok, otherwise the
+    //            code of the error and the body is the error message)
+    //   Compile  body: pattern bytes -> body: u32 pattern id, the same
+    //            pattern compiled again returns the same id
+    //   Match    body: u32 id, u32 n, n times (u32 len, bytes)
+    //            -> body: u32 n, n times u8 (1 if the buffer contains a match)
+    //   Count    body: as Match -> body: u32 n, n times u64 (number of
+    //            non-overlapping matches in the buffer)
+    // Every connection is served by its own detached thread.
+    class Server {
+        public:
+        enum class Op : uint8_t {
+            Compile = 1,
+            Match = 2,
+            Count = 3,
+        };
+        // status of replies to malformed requests and unknown ids
+        static const uint8_t bad_request = 1;
+        static const uint32_t max_frame_size = 1u << 30;
+
+        // removes a stale socket at the path
+        Server(std::string socket_path, size_t max_programs = 1024, size_t memory_budget = 0);
+        Server(Server const&) = delete;
+        Server& operator=(Server const&) = delete;
+        ~Server();
+
+        // accepts connections until stop() is called, returns when all
+        // the connections are closed
+        void run();
+        // safe to call from any thread, but not from a signal handler
+        void stop();
+        size_t program_count();
+
+        private:
+        struct Program {
+            Program(std::string const& pattern, size_t memory_budget);
+
+            std::string pattern;
+            CSA csa;
+            // stamp of the last compile or request using the program
+            uint64_t last_use;
+        };
+
+        // the config of a connection keeps its program alive
+        struct Session {
+            Session() : program(), config() {}
+
+            std::shared_ptr<Program> program;
+            std::unique_ptr<Config> config;
+        };
+        using Sessions = std::unordered_map<unsigned, Session>;
+
+        unsigned compile(std::string const& pattern);
+        std::shared_ptr<Program> program(unsigned id);
+        void serve(int fd);
+        // returns the status of the reply, the reply body is appended to out
+        uint8_t handle(std::string_view request, Sessions& sessions, std::string& out);
+
+        std::string socket_path_;
+        int listen_fd_;
+        std::atomic<bool> stopped_;
+
+        std::mutex programs_mutex_;
+        std::unordered_map<unsigned, std::shared_ptr<Program>> programs_;
+        std::unordered_map<std::string, unsigned> program_ids_;
+        unsigned next_id_;
+        uint64_t use_stamp_;
+        size_t max_programs_;
+        size_t memory_budget_;
+
+        std::mutex connections_mutex_;
+        std::unordered_set<int> connections_;
+        // notified when the last connection is closed
+        std::condition_variable idle_;
+    };
+
+} // namespace CSA
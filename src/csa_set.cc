@@ -0,0 +1,107 @@
+#include "csa_set.hh"
+
+#include <algorithm>
+
+namespace CSA {
+
+static CA::CA<uint8_t> build_set_ca(std::vector<std::string> const& patterns,
+        CA::glushkov::PatternTags& tags) {
+    std::vector<std::string_view> views(patterns.begin(), patterns.end());
+    return CA::glushkov::Builder::get_set_ca(views, tags);
+}
+
+PatternSet::PatternSet(std::vector<std::string> const& patterns)
+    : size_(patterns.size()), tags_(), csa_(build_set_ca(patterns, tags_)),
+    config_(csa_), accepting_() { }
+
+void PatternSet::match(std::string_view text, std::vector<unsigned>& ids) {
+    ids.clear();
+    if (size_ == 0) {
+        return;
+    }
+    config_.reset();
+    for (char c : text) {
+        if (!config_.step(c)) {
+            config_.reset();
+            return;
+        }
+    }
+    collect_ids(ids);
+    config_.reset();
+}
+
+void PatternSet::collect_ids(std::vector<unsigned>& ids) {
+    accepting_.clear();
+    config_.accepting_states(accepting_);
+    for (auto state : accepting_) {
+        if (state == CA::InitState) {
+            ids.insert(ids.end(), tags_.init_patterns.begin(), tags_.init_patterns.end());
+        } else if (state == csa_.ca().any_loop_start()) {
+            ids.insert(ids.end(), tags_.loop_patterns.begin(), tags_.loop_patterns.end());
+        } else {
+            ids.push_back(tags_.state_pattern[state]);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+unsigned LivePatternSet::add(std::string pattern) {
+    // new patterns go to the newest shard, the full ones stay untouched
+    bool new_shard = shards_.empty() || shards_.back()->patterns.size() >= shard_size_;
+    std::vector<std::string> patterns;
+    if (!new_shard) {
+        patterns = shards_.back()->patterns;
+    }
+    patterns.push_back(std::move(pattern));
+    // built before anything is changed so a failure leaves the set as it was
+    auto set = std::make_unique<PatternSet>(patterns);
+
+    if (new_shard) {
+        shards_.push_back(std::make_unique<Shard>());
+    }
+    auto& shard = *shards_.back();
+    unsigned id = next_id_++;
+    shard.ids.push_back(id);
+    shard.patterns = std::move(patterns);
+    shard.set = std::move(set);
+    shard_of_[id] = &shard;
+    return id;
+}
+
+bool LivePatternSet::remove(unsigned id) {
+    auto it = shard_of_.find(id);
+    if (it == shard_of_.end()) {
+        return false;
+    }
+    auto& shard = *it->second;
+    auto pos = std::find(shard.ids.begin(), shard.ids.end(), id) - shard.ids.begin();
+    if (shard.ids.size() == 1) {
+        shard_of_.erase(it);
+        std::erase_if(shards_, [&] (auto const& s) { return s.get() == &shard; });
+        return true;
+    }
+    // rebuilt before anything is changed so a failure leaves the set as it was
+    auto patterns = shard.patterns;
+    patterns.erase(patterns.begin() + pos);
+    auto set = std::make_unique<PatternSet>(patterns);
+
+    shard_of_.erase(it);
+    shard.ids.erase(shard.ids.begin() + pos);
+    shard.patterns = std::move(patterns);
+    shard.set = std::move(set);
+    return true;
+}
+
+void LivePatternSet::match(std::string_view text, std::vector<unsigned>& ids) {
+    ids.clear();
+    for (auto& shard : shards_) {
+        shard->set->match(text, local_ids_);
+        for (auto local : local_ids_) {
+            ids.push_back(shard->ids[local]);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+}
+
+} // namespace CSA
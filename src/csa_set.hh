@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "csa.hh"
+#include "glushkov.hh"
+
+namespace CSA {
+
+    // Matches a set of patterns in one pass using one CSA built from the
+    // union of the patterns. The counters of the patterns stay distinct,
+    // the final states are tagged by the indexes of the patterns.
+    class PatternSet {
+        public:
+        PatternSet(std::vector<std::string> const& patterns);
+        PatternSet(PatternSet const&) = delete;
+        PatternSet& operator=(PatternSet const&) = delete;
+
+        // sets ids to the sorted indexes of the patterns found in text
+        void match(std::string_view text, std::vector<unsigned>& ids);
+        size_t size() const { return size_; }
+        CSA& csa() { return csa_; }
+
+        private:
+        void collect_ids(std::vector<unsigned>& ids);
+
+        size_t size_;
+        CA::glushkov::PatternTags tags_;
+        CSA csa_;
+        Config config_;
+        std::vector<CA::StateId> accepting_;
+    };
+
+    // Pattern set supporting adding and removing patterns without rebuilding
+    // everything. The patterns are split into shards of at most shard_size
+    // patterns, each a PatternSet with its own lazy CSA cache. A change
+    // rebuilds only the shard it touches, the caches of the other shards
+    // stay warm.
+    class LivePatternSet {
+        public:
+        LivePatternSet(size_t shard_size = 32)
+            : shards_(), shard_of_(), next_id_(0), shard_size_(shard_size), local_ids_() {}
+
+        // returns the id used to report and remove the pattern
+        unsigned add(std::string pattern);
+        // returns false if there is no pattern with the id
+        bool remove(unsigned id);
+
+        // sets ids to the sorted ids of the patterns found in text
+        void match(std::string_view text, std::vector<unsigned>& ids);
+        size_t size() const { return shard_of_.size(); }
+        size_t shard_count() const { return shards_.size(); }
+
+        private:
+        struct Shard {
+            Shard() : ids(), patterns(), set() {}
+
+            std::vector<unsigned> ids;
+            std::vector<std::string> patterns;
+            std::unique_ptr<PatternSet> set;
+        };
+
+        std::vector<std::unique_ptr<Shard>> shards_;
+        std::unordered_map<unsigned, Shard*> shard_of_;
+        unsigned next_id_;
+        size_t shard_size_;
+        std::vector<unsigned> local_ids_;
+    };
+
+} // namespace CSA
@@ -0,0 +1,598 @@
+#include "csa_shared.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace CSA {
+
+namespace {
+
+    const uint64_t shared_cache_magic = 0x4353414341434845; // "CSACACHE"
+    const uint32_t null_state = ~0u;
+    // kinds of the records of the image
+    const uint32_t state_record = 1;
+    const uint32_t trans_record = 2;
+    // the creator initializes the segment right after creating it, a
+    // segment that is still not initialized after this was left by a
+    // creator that died
+    const auto init_timeout = std::chrono::seconds(1);
+
+    // FNV-1a, stable between the processes and builds sharing a segment
+    uint64_t fingerprint(std::string_view pattern, uint8_t bytemap_range) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (char c : pattern) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+        }
+        return (hash ^ bytemap_range) * 0x100000001b3;
+    }
+
+    // waits for the condition until the deadline
+    template<typename F>
+    bool wait_for(F ready, std::chrono::steady_clock::time_point deadline) {
+        while (!ready()) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return true;
+    }
+
+    class ImageWriter {
+        public:
+        ImageWriter(std::vector<uint32_t> const& image_ids) : words_(), image_ids_(image_ids) {}
+
+        void put(uint32_t word) { words_.push_back(word); }
+
+        // the states are referenced by their index in the image
+        void put_state(CachedState const* state) {
+            put(state ? image_ids_[state->id()] : null_state);
+        }
+
+        void put_update(Update const& update) {
+            put(static_cast<uint32_t>(update.type()));
+            put_state(update.next_state());
+            put(update.prog().size());
+            for (auto const& inst : update.prog()) {
+                put(static_cast<uint32_t>(inst.type()));
+                // shares the storage with index and max of Incr
+                put(inst.origin());
+                put(inst.target());
+            }
+        }
+
+        std::vector<uint32_t> words() { return std::move(words_); }
+
+        private:
+        std::vector<uint32_t> words_;
+        std::vector<uint32_t> const& image_ids_;
+    };
+
+    class ImageReader {
+        public:
+        ImageReader(uint32_t const* image, size_t pos, size_t size, std::vector<CachedState*>& states)
+            : image_(image), size_(size), pos_(pos), states_(states) {}
+        ImageReader(ImageReader const&) = delete;
+        ImageReader& operator=(ImageReader const&) = delete;
+
+        uint32_t get() {
+            if (pos_ >= size_) {
+                FATAL_ERROR("truncated CSA image", Errors::SharedMemory);
+            }
+            return image_[pos_++];
+        }
+        bool done() const { return pos_ == size_; }
+        size_t pos() const { return pos_; }
+
+        uint32_t get_index() {
+            uint32_t index = get();
+            if (index >= states_.size()) {
+                FATAL_ERROR("state index out of the CSA image", Errors::SharedMemory);
+            }
+            return index;
+        }
+        CachedState* get_state() {
+            uint32_t index = get();
+            if (index == null_state) {
+                return nullptr;
+            }
+            if (index >= states_.size()) {
+                FATAL_ERROR("state index out of the CSA image", Errors::SharedMemory);
+            }
+            return states_[index];
+        }
+
+        OrdVector<uint32_t> get_vec() {
+            OrdVector<uint32_t> vec;
+            for (uint32_t n = get(); n > 0; --n) {
+                vec.push_back(get());
+            }
+            return vec;
+        }
+
+        // the update is interned in the pool of the CSA
+        Update const* get_update(CSA& csa) {
+            auto type = static_cast<UpdateEnum>(get());
+            CachedState* next_state = get_state();
+            UpdateProg prog;
+            for (uint32_t n = get(); n > 0; --n) {
+                auto inst_type = static_cast<CntSetInstEnum>(get());
+                uint32_t arg1 = get();
+                uint32_t arg2 = get();
+                prog.emplace_back(inst_type, arg1, arg2);
+            }
+            return csa.get_update(type, next_state, prog);
+        }
+
+        private:
+        uint32_t const* image_;
+        size_t size_;
+        size_t pos_;
+        std::vector<CachedState*>& states_;
+    };
+
+    uint32_t lazy_updates(LazyTrans const& lazy) {
+        uint32_t count = 0;
+        lazy.for_each([&](uint64_t, Update const&) { ++count; });
+        return count;
+    }
+
+} // anonymous namespace
+
+struct SharedCache::Header {
+    std::atomic<uint32_t> ready;
+    uint64_t magic;
+    uint64_t fingerprint;
+    uint64_t capacity; // of the image in words
+    pthread_mutex_t mutex;
+    std::atomic<uint64_t> generation;
+    std::atomic<uint64_t> size; // of the image in words
+
+    uint32_t* image() { return reinterpret_cast<uint32_t*>(this + 1); }
+};
+
+// Maps the states of an image to the states of one CSA and remembers the
+// transitions the image holds, so that only new records are read and
+// written. A flush of the cache of the CSA invalidates it.
+struct SharedCache::ImageIndex {
+    ImageIndex() : csa(nullptr), flushes(0), read(0), states(), image_ids(), trans() {}
+    ImageIndex(ImageIndex const&) = default;
+    ImageIndex(ImageIndex&&) = default;
+    ImageIndex& operator=(ImageIndex const&) = default;
+    ImageIndex& operator=(ImageIndex&&) = default;
+
+    // starts over if the index is not of the current cache of the CSA
+    bool sync(CSA const& csa) {
+        if (this->csa == &csa && flushes == csa.flushes()) {
+            return true;
+        }
+        *this = ImageIndex();
+        this->csa = &csa;
+        flushes = csa.flushes();
+        return false;
+    }
+
+    void add_state(CachedState* state) {
+        if (state->id() >= image_ids.size()) {
+            image_ids.resize(state->id() + 1, null_state);
+        }
+        // the first record of a state is the one referenced by the others
+        if (image_ids[state->id()] == null_state) {
+            image_ids[state->id()] = states.size();
+        }
+        states.push_back(state);
+    }
+
+    bool has_state(CachedState const* state) const {
+        return state->id() < image_ids.size() && image_ids[state->id()] != null_state;
+    }
+
+    static uint64_t trans_key(uint32_t image_id, unsigned byte_class) {
+        return static_cast<uint64_t>(image_id) << 8 | byte_class;
+    }
+
+    CSA const* csa;
+    uint64_t flushes;
+    // words of the image read
+    size_t read;
+    // by the index in the image
+    std::vector<CachedState*> states;
+    // index in the image by the id of the state
+    std::vector<uint32_t> image_ids;
+    // updates of the transitions in the image by the index of the state and
+    // the byte class, 1 for the transitions that are not lazy
+    std::unordered_map<uint64_t, uint32_t> trans;
+};
+
+SharedCache::SharedCache(std::string const& name, std::string_view pattern, CSA const& csa, size_t capacity)
+    : header_(nullptr), mapped_size_(0), imported_generation_(0), index_(std::make_unique<ImageIndex>()) {
+    uint64_t print = fingerprint(pattern, csa.ca().bytemap_range());
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        mapped_size_ = sizeof(Header) + capacity / sizeof(uint32_t) * sizeof(uint32_t);
+        if (ftruncate(fd, mapped_size_) != 0) {
+            close(fd);
+            shm_unlink(name.c_str());
+            FATAL_ERROR("failed to resize shared memory " << name << ": " << strerror(errno),
+                    Errors::SharedMemory);
+        }
+        void* mem = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            FATAL_ERROR("failed to map shared memory " << name << ": " << strerror(errno),
+                    Errors::SharedMemory);
+        }
+        header_ = static_cast<Header*>(mem);
+        header_->magic = shared_cache_magic;
+        header_->fingerprint = print;
+        header_->capacity = capacity / sizeof(uint32_t);
+        header_->size.store(0, std::memory_order_relaxed);
+        header_->generation.store(0, std::memory_order_relaxed);
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        // a worker that dies holding the lock does not block the others
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header_->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        header_->ready.store(1, std::memory_order_release);
+        return;
+    }
+    if (errno != EEXIST) {
+        FATAL_ERROR("failed to open shared memory " << name << ": " << strerror(errno),
+                Errors::SharedMemory);
+    }
+
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        FATAL_ERROR("failed to open shared memory " << name << ": " << strerror(errno),
+                Errors::SharedMemory);
+    }
+    // the creator could still be initializing the segment
+    auto deadline = std::chrono::steady_clock::now() + init_timeout;
+    struct stat st;
+    bool sized = wait_for([&] {
+        return fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) >= sizeof(Header);
+    }, deadline);
+    if (!sized || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        close(fd);
+        FATAL_ERROR("shared memory " << name << " was not initialized by its creator",
+                Errors::SharedMemory);
+    }
+    mapped_size_ = st.st_size;
+    void* mem = mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        FATAL_ERROR("failed to map shared memory " << name << ": " << strerror(errno),
+                Errors::SharedMemory);
+    }
+    header_ = static_cast<Header*>(mem);
+    if (!wait_for([&] { return header_->ready.load(std::memory_order_acquire) != 0; }, deadline)) {
+        munmap(header_, mapped_size_);
+        header_ = nullptr;
+        FATAL_ERROR("shared memory " << name << " was not initialized by its creator",
+                Errors::SharedMemory);
+    }
+    if (header_->magic != shared_cache_magic || header_->fingerprint != print) {
+        munmap(header_, mapped_size_);
+        header_ = nullptr;
+        FATAL_ERROR("shared memory " << name << " holds a cache of another pattern",
+                Errors::SharedMemory);
+    }
+    // the image must fit in what was mapped
+    if (header_->capacity > (mapped_size_ - sizeof(Header)) / sizeof(uint32_t)) {
+        munmap(header_, mapped_size_);
+        header_ = nullptr;
+        FATAL_ERROR("shared memory " << name << " is smaller than its capacity",
+                Errors::SharedMemory);
+    }
+}
+
+SharedCache::~SharedCache() {
+    if (header_) {
+        munmap(header_, mapped_size_);
+    }
+}
+
+void SharedCache::remove(std::string const& name) {
+    shm_unlink(name.c_str());
+}
+
+uint64_t SharedCache::generation() const {
+    return header_->generation.load(std::memory_order_acquire);
+}
+
+size_t SharedCache::image_size() const {
+    return header_->size.load(std::memory_order_relaxed);
+}
+
+void SharedCache::lock() {
+    int res = pthread_mutex_lock(&header_->mutex);
+    if (res == EOWNERDEAD) {
+        // the size is stored after the records are written, so the image
+        // is consistent
+        pthread_mutex_consistent(&header_->mutex);
+    } else if (res != 0) {
+        FATAL_ERROR("failed to lock shared memory: " << strerror(res), Errors::SharedMemory);
+    }
+}
+
+void SharedCache::unlock() {
+    pthread_mutex_unlock(&header_->mutex);
+}
+
+bool SharedCache::import(CSA& csa) {
+    // checked without the lock, workers that are up to date do not contend
+    if (index_->sync(csa) && generation() == imported_generation_) {
+        return false;
+    }
+    lock();
+    try {
+        bool res = import_locked(csa);
+        unlock();
+        return res;
+    } catch (...) {
+        unlock();
+        throw;
+    }
+}
+
+bool SharedCache::import_locked(CSA& csa) {
+    index_->sync(csa);
+    imported_generation_ = generation();
+    return read_records(csa, *index_, header_->image(), header_->size.load(std::memory_order_relaxed));
+}
+
+bool SharedCache::publish(CSA& csa) {
+    lock();
+    try {
+        import_locked(csa);
+        auto records = write_records(csa, *index_);
+        size_t size = header_->size.load(std::memory_order_relaxed);
+        if (records.size() > header_->capacity - size) {
+            // the index holds the records that were not written
+            *index_ = ImageIndex();
+            unlock();
+            return false;
+        }
+        if (!records.empty()) {
+            std::memcpy(header_->image() + size, records.data(), records.size() * sizeof(uint32_t));
+            header_->size.store(size + records.size(), std::memory_order_relaxed);
+            index_->read = size + records.size();
+            imported_generation_ = header_->generation.fetch_add(1, std::memory_order_release) + 1;
+        }
+        unlock();
+        return true;
+    } catch (...) {
+        unlock();
+        throw;
+    }
+}
+
+// Image layout, all words are uint32_t, each record starts with its kind:
+//   state record: normal states, counter states with their index sets,
+//       number of counting sets, the state gets the next index
+//   transition record: index of the state, byte class, type and the
+//       payload of the type, the states are referenced by their indexes
+// A lazy transition is written again when it has more updates than in the
+// image, reading it adds the updates that are missing.
+std::vector<uint32_t> SharedCache::write_records(CSA& csa, ImageIndex& index) {
+    auto lock = csa.lock();
+    index.sync(csa);
+    ImageWriter out(index.image_ids);
+    auto& states = *csa.states_;
+    for (StateIndex id = 0; id < states.size(); ++id) {
+        auto* cached = states.at(id);
+        if (index.has_state(cached)) {
+            continue;
+        }
+        index.add_state(cached);
+        out.put(state_record);
+        out.put(cached->normal().size());
+        for (auto ca_state : cached->normal()) {
+            out.put(ca_state);
+        }
+        out.put(cached->counter_count());
+        for (uint32_t i = 0; i < cached->counter_count(); ++i) {
+            auto cnt_state = cached->counter_at(i);
+            out.put(cnt_state.state());
+            out.put(cnt_state.actual().size());
+            for (auto counter_index : cnt_state.actual()) {
+                out.put(counter_index);
+            }
+            out.put(cnt_state.postponed().size());
+            for (auto counter_index : cnt_state.postponed()) {
+                out.put(counter_index);
+            }
+        }
+        out.put(cached->cnt_sets());
+    }
+    auto range = csa.ca().bytemap_range();
+    for (StateIndex id = 0; id < states.size(); ++id) {
+        auto* cached = states.at(id);
+        uint32_t image_id = index.image_ids[cached->id()];
+        for (unsigned byte_class = 0; byte_class < range; ++byte_class) {
+            auto& trans = cached->trans(byte_class);
+            auto type = trans.type();
+            if (type == TransEnum::NotComputed) {
+                continue;
+            }
+            uint32_t updates = type == TransEnum::Lazy ? lazy_updates(*trans.lazy()) : 1;
+            auto& written = index.trans[ImageIndex::trans_key(image_id, byte_class)];
+            if (written >= updates) {
+                continue;
+            }
+            written = updates;
+            out.put(trans_record);
+            out.put(image_id);
+            out.put(byte_class);
+            out.put(static_cast<uint32_t>(type));
+            switch (type) {
+                case TransEnum::WithoutCntState:
+                case TransEnum::EnteringCntState:
+                    out.put_state(trans.next_state());
+                    break;
+                case TransEnum::NoCondition:
+                    out.put_update(*trans.update());
+                    break;
+                case TransEnum::Small:
+                    out.put(trans.small()->guards().size());
+                    for (auto const& guard : trans.small()->guards()) {
+                        out.put(guard.state);
+                        out.put(static_cast<uint32_t>(guard.condition));
+                    }
+                    out.put(trans.small()->updates().size());
+                    for (auto const& update : trans.small()->updates()) {
+                        out.put_update(*update);
+                    }
+                    break;
+                case TransEnum::Lazy: {
+                    std::vector<std::pair<uint64_t, Update const*>> lazy;
+                    trans.lazy()->for_each([&](uint64_t guards, Update const& update) {
+                        lazy.emplace_back(guards, &update);
+                    });
+                    out.put(lazy.size());
+                    for (auto const& [guards, update] : lazy) {
+                        out.put(guards & 0xffffffff);
+                        out.put(guards >> 32);
+                        out.put_update(*update);
+                    }
+                    break;
+                }
+                default:
+                    FATAL_ERROR("unexpected type of transition", Errors::InternalFailure);
+            }
+        }
+    }
+    return out.words();
+}
+
+bool SharedCache::read_records(CSA& csa, ImageIndex& index, uint32_t const* image, size_t size) {
+    if (index.read >= size) {
+        return false;
+    }
+    auto lock = csa.lock();
+    ImageReader in(image, index.read, size, index.states);
+    while (!in.done()) {
+        auto kind = in.get();
+        if (kind == state_record) {
+            NormalStateVec normal = in.get_vec();
+            CounterStateMap counter;
+            for (uint32_t n = in.get(); n > 0; --n) {
+                // the insert keeps the map sorted even if the image is not
+                auto& cnt_state = counter.insert(in.get());
+                for (auto counter_index : in.get_vec()) {
+                    cnt_state.actual().insert(counter_index);
+                }
+                for (auto counter_index : in.get_vec()) {
+                    cnt_state.postponed().insert(counter_index);
+                }
+            }
+            unsigned cnt_sets = in.get();
+            index.add_state(csa.get_state(State(std::move(normal), std::move(counter), cnt_sets)));
+            continue;
+        }
+        if (kind != trans_record) {
+            FATAL_ERROR("unexpected record in the CSA image", Errors::SharedMemory);
+        }
+        uint32_t image_id = in.get_index();
+        auto* cached = index.states[image_id];
+        uint32_t byte_class = in.get();
+        if (byte_class >= csa.ca().bytemap_range()) {
+            FATAL_ERROR("byte class out of the CSA image", Errors::SharedMemory);
+        }
+        auto& trans = cached->trans(byte_class);
+        bool missing = trans.type() == TransEnum::NotComputed;
+        uint32_t updates = 1;
+        switch (static_cast<TransEnum>(in.get())) {
+            case TransEnum::WithoutCntState: {
+                auto next = in.get_state();
+                if (missing) {
+                    trans.set_next_state(next, TransEnum::WithoutCntState);
+                }
+                break;
+            }
+            case TransEnum::EnteringCntState: {
+                auto next = in.get_state();
+                if (missing) {
+                    trans.set_next_state(next, TransEnum::EnteringCntState);
+                }
+                break;
+            }
+            case TransEnum::NoCondition: {
+                auto update = in.get_update(csa);
+                if (missing) {
+                    trans.set_update(update);
+                }
+                break;
+            }
+            case TransEnum::Small: {
+                GuardVec guards;
+                for (uint32_t g = in.get(); g > 0; --g) {
+                    CA::StateId state = in.get();
+                    guards.push_back(Guard{state, static_cast<CA::Guard>(in.get())});
+                }
+                auto small = std::make_unique<SmallTrans>(std::move(guards));
+                for (uint32_t u = in.get(); u > 0; --u) {
+                    small->add_update(in.get_update(csa));
+                }
+                if (missing) {
+                    trans.set_small(small.release());
+                }
+                break;
+            }
+            case TransEnum::Lazy: {
+                if (missing) {
+                    trans.set_lazy(new LazyTrans(
+                                GuardedTransBuilder(csa.ca(), cached->state(), byte_class)));
+                }
+                updates = in.get();
+                for (uint32_t u = updates; u > 0; --u) {
+                    uint64_t guards = in.get();
+                    guards |= static_cast<uint64_t>(in.get()) << 32;
+                    auto update = in.get_update(csa);
+                    if (trans.type() == TransEnum::Lazy) {
+                        trans.lazy()->add(guards, update);
+                    }
+                }
+                break;
+            }
+            default:
+                FATAL_ERROR("unexpected type of transition in the CSA image", Errors::SharedMemory);
+        }
+        if (missing) {
+            csa.charge(trans.memory());
+        }
+        auto& read = index.trans[ImageIndex::trans_key(image_id, byte_class)];
+        read = std::max(read, updates);
+    }
+    index.read = in.pos();
+    return true;
+}
+
+std::vector<uint32_t> SharedCache::export_image(CSA& csa) {
+    ImageIndex index;
+    return write_records(csa, index);
+}
+
+void SharedCache::import_image(CSA& csa, uint32_t const* image, size_t size) {
+    ImageIndex index;
+    index.sync(csa);
+    read_records(csa, index, image, size);
+}
+
+} // namespace CSA
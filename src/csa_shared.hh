@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "csa.hh"
+
+namespace CSA {
+
+    // Cache of computed CSA states in a POSIX shared memory segment, used by
+    // preforked workers matching the same pattern to determinise each state
+    // only once. The segment holds a position independent log of records:
+    // a state record adds a state to the image, a transition record adds a
+    // computed transition of a state, and states are referenced by their
+    // index in the image instead of pointers. A worker reads only the
+    // records appended since its last import into its own CSA and appends
+    // only the states and transitions it computed that the segment lacks.
+    // Both are done under a robust process shared mutex in the segment.
+    class SharedCache {
+        public:
+        // opens the segment with the name, it is created with the capacity
+        // (in bytes) if it does not exist, the pattern must be the same in
+        // all processes using the segment and the CSA compiled from it
+        SharedCache(std::string const& name, std::string_view pattern, CSA const& csa, size_t capacity);
+        SharedCache(SharedCache const&) = delete;
+        SharedCache& operator=(SharedCache const&) = delete;
+        ~SharedCache();
+
+        // loads the records published since the last import into the CSA,
+        // returns false if there was nothing new
+        bool import(CSA& csa);
+        // appends the states and transitions of the CSA missing in the
+        // segment, returns false if they do not fit
+        bool publish(CSA& csa);
+
+        uint64_t generation() const;
+        // words of the image in the segment
+        size_t image_size() const;
+        // the segment is kept until it is removed by its name
+        static void remove(std::string const& name);
+
+        // the image of the whole CSA without the segment, for testing
+        static std::vector<uint32_t> export_image(CSA& csa);
+        static void import_image(CSA& csa, uint32_t const* image, size_t size);
+
+        private:
+        struct Header;
+        struct ImageIndex;
+
+        void lock();
+        void unlock();
+        bool import_locked(CSA& csa);
+
+        // reads the records after the part of the image already in the
+        // index into the CSA, returns false if there were none
+        static bool read_records(CSA& csa, ImageIndex& index, uint32_t const* image, size_t size);
+        // the records of the states and transitions of the CSA missing in
+        // the index, which then holds them
+        static std::vector<uint32_t> write_records(CSA& csa, ImageIndex& index);
+
+        Header* header_;
+        size_t mapped_size_;
+        uint64_t imported_generation_;
+        // what the CSA already has of the segment
+        std::unique_ptr<ImageIndex> index_;
+    };
+
+} // namespace CSA
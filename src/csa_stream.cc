@@ -0,0 +1,68 @@
+#include "csa_stream.hh"
+
+#include <utility>
+
+namespace CSA {
+
+MatchStream& MatchStream::operator=(MatchStream&& other) noexcept {
+    if (this != &other) {
+        if (handle_) {
+            handle_.destroy();
+        }
+        handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+}
+
+std::optional<uint64_t> MatchStream::next() {
+    if (done()) {
+        return std::nullopt;
+    }
+    auto& promise = handle_.promise();
+    if (promise.waiting_ && !promise.has_input()) {
+        return std::nullopt;
+    }
+    handle_.resume();
+    if (promise.exception_) {
+        std::rethrow_exception(std::exchange(promise.exception_, nullptr));
+    }
+    return std::exchange(promise.value_, std::nullopt);
+}
+
+MatchStream stream_matches(Config& config) {
+    uint64_t offset = 0; // offset of the next byte
+    bool restarted = true; // config is in the initial state
+    bool searching = true; // false after the config died, no more matches
+    config.reset();
+    while (auto chunk = co_await MatchStream::Input{}) {
+        for (char c : *chunk) {
+            if (!searching) {
+                break;
+            }
+            // the end of the input is not known yet, so only the matches
+            // that do not need an end anchor are reported inside it
+            if (restarted && config.accepting(false)) {
+                // empty match, the byte is skipped to not find it again
+                co_yield offset;
+                ++offset;
+                config.restart();
+                continue;
+            }
+            restarted = false;
+            ++offset;
+            if (!config.step(c)) {
+                searching = false;
+            } else if (config.accepting(false)) {
+                co_yield offset;
+                config.restart();
+                restarted = true;
+            }
+        }
+    }
+    if (searching && config.accepting()) {
+        co_yield offset;
+    }
+    config.reset();
+}
+
+} // namespace CSA
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <string_view>
+
+#include "csa.hh"
+
+namespace CSA {
+
+    // Coroutine yielding the end offsets of the non-overlapping matches in
+    // input that arrives in chunks. The matching semantics are the same as
+    // in Matcher::count. When the fed chunk is consumed the coroutine
+    // suspends and next() returns nullopt until more input is fed.
+    class MatchStream {
+        public:
+        struct promise_type {
+            std::optional<uint64_t> value_{};
+            std::optional<std::string_view> chunk_{};
+            bool closed_ = false;
+            bool waiting_ = false;
+            std::exception_ptr exception_{};
+
+            MatchStream get_return_object() {
+                return MatchStream(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            std::suspend_always yield_value(uint64_t offset) noexcept {
+                value_ = offset;
+                return {};
+            }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { exception_ = std::current_exception(); }
+
+            bool has_input() const { return chunk_.has_value() || closed_; }
+        };
+
+        // awaited by the coroutine to get the next chunk, nullopt is
+        // returned after the input was closed
+        class Input {
+            public:
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                promise_ = &handle.promise();
+                promise_->waiting_ = !promise_->has_input();
+                return promise_->waiting_;
+            }
+            std::optional<std::string_view> await_resume() noexcept {
+                promise_->waiting_ = false;
+                auto chunk = promise_->chunk_;
+                promise_->chunk_.reset();
+                return chunk;
+            }
+
+            private:
+            promise_type* promise_ = nullptr;
+        };
+
+        MatchStream(MatchStream&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+        MatchStream(MatchStream const&) = delete;
+        MatchStream& operator=(MatchStream const&) = delete;
+        MatchStream& operator=(MatchStream&& other) noexcept;
+        ~MatchStream() { if (handle_) { handle_.destroy(); } }
+
+        // the chunk must stay valid until next() returns nullopt
+        void feed(std::string_view chunk) { handle_.promise().chunk_ = chunk; }
+        // marks the end of the input
+        void close() { handle_.promise().closed_ = true; }
+        // end offset of the next match or nullopt when more input is needed
+        std::optional<uint64_t> next();
+        bool done() const { return !handle_ || handle_.done(); }
+
+        private:
+        // only the promise creates the stream
+        friend promise_type;
+        explicit MatchStream(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    // the config must outlive the stream and must not be used by anything
+    // else until the stream is done
+    MatchStream stream_matches(Config& config);
+
+} // namespace CSA
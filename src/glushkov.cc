@@ -4,31 +4,87 @@
 #include "csa_errors.hh"
 
 #include <algorithm>
+#include <memory>
 #include <cstdint>
 #include <iterator>
+#include <unordered_map>
 #include <string>
 #include <unordered_set>
 #include <vector>
 
 namespace CA::glushkov {
 
-    Builder::Builder(std::string_view pattern) 
-        : regex_(re2::regex::Regex(pattern)), ca_(), range_builder_(),
-        range_states_() {
-        ca_.set_bytemap(regex_.bytemap());
-        ca_.set_bytemap_range(regex_.bytemap_range());
+    Builder::Builder(std::vector<std::string_view> const& patterns) 
+        : regexes_(), ca_(), tags_(), pattern_(0), range_builder_(),
+        range_states_(), literal_classes_() {
+        for (auto pattern : patterns) {
+            regexes_.push_back(std::make_unique<re2::regex::Regex>(pattern));
+        }
+        set_bytemap();
+
+        tags_.state_pattern.push_back(SharedState); // initial state
+        for (unsigned i = 0; i < regexes_.size(); ++i) {
+            add_pattern(i, regexes_[i]->regexp());
+            tags_.state_pattern.resize(ca_.state_count(), i);
+        }
+        if (ca_.any_loop_start() != InitState) {
+            tags_.state_pattern[ca_.any_loop_start()] = SharedState;
+        }
+    }
+
+    void Builder::set_bytemap() {
+        if (regexes_.size() == 1) {
+            ca_.set_bytemap(regexes_[0]->bytemap());
+            ca_.set_bytemap_range(regexes_[0]->bytemap_range());
+            return;
+        }
+        // the byte class of the set is given by the byte classes of
+        // the byte in all the patterns
+        std::vector<unsigned> classes(ByteMapSize, 0);
+        unsigned range = 1;
+        for (auto const& regex : regexes_) {
+            std::unordered_map<unsigned, unsigned> refined;
+            for (unsigned i = 0; i < ByteMapSize; ++i) {
+                auto key = classes[i] * ByteMapSize + regex->bytemap()[i];
+                auto it = refined.try_emplace(key, refined.size()).first;
+                classes[i] = it->second;
+            }
+            range = refined.size();
+        }
+        // the value of the range is used as the symbol matching any byte
+        if (range >= ByteMapSize) {
+            FATAL_ERROR("too many byte classes in the pattern set", CSA::Errors::UnsupportedOperation);
+        }
+        uint8_t bytemap[ByteMapSize];
+        for (unsigned i = 0; i < ByteMapSize; ++i) {
+            bytemap[i] = static_cast<uint8_t>(classes[i]);
+        }
+        ca_.set_bytemap(bytemap);
+        ca_.set_bytemap_range(static_cast<uint8_t>(range));
+    }
 
-        Fragment frag = compute_fragment(regex_.regexp(), NoCounter);
+    void Builder::add_pattern(unsigned id, re2::Regexp *re) {
+        pattern_ = id;
+        Fragment frag = compute_fragment(re, NoCounter);
 
         // stuff to add if some parts are unanchored
         assert(frag.anchor_flag == NoAnchor);
         if (!frag.first.empty()) {
-            auto any_loop_start = ca_.add_state(NoCounter);
+            // the loop is shared by all the patterns of a set
+            auto any_loop_start = ca_.any_loop_start();
+            bool new_loop = any_loop_start == InitState;
+            if (new_loop) {
+                any_loop_start = ca_.add_state(NoCounter);
+                ca_.set_any_loop_start(any_loop_start);
+            }
             if (frag.nullable) {
                 ca_.get_state(any_loop_start).set_final(ca_.get_counters());
+                tags_.loop_patterns.push_back(id);
+            }
+            if (new_loop) {
+                add_transition_init(ca_.get_init(), any_loop_start, ca_.bytemap_range());
+                add_transition(any_loop_start, any_loop_start, ca_.bytemap_range());
             }
-            add_transition_init(ca_.get_init(), any_loop_start, ca_.bytemap_range());
-            add_transition(any_loop_start, any_loop_start, ca_.bytemap_range());
             for (auto &first : frag.first) {
                 add_transition(any_loop_start, first.state, first.byte_class);
             }
@@ -51,7 +107,14 @@ namespace CA::glushkov {
             ca_.get_state(last).set_final(ca_.get_counters());
         }
         if (frag.nullable) {
-            init.set_final(ca_.get_counters());
+            set_init_final();
+        }
+    }
+
+    void Builder::set_init_final(bool end_only) {
+        ca_.get_init().set_final(ca_.get_counters(), end_only);
+        if (tags_.init_patterns.empty() || tags_.init_patterns.back() != pattern_) {
+            tags_.init_patterns.push_back(pattern_);
         }
     }
     
@@ -240,30 +303,46 @@ namespace CA::glushkov {
     }
 
 
+    std::vector<Symbol> const& Builder::literal_classes(char byte) {
+        literal_classes_.clear();
+        auto c = static_cast<uint8_t>(byte);
+        if (regexes_.size() == 1) {
+            literal_classes_.push_back(ca_.get_byte_class(c));
+            return literal_classes_;
+        }
+        auto bytemap = regexes_[pattern_]->bytemap();
+        for (unsigned i = 0; i < ByteMapSize; ++i) {
+            if (bytemap[i] != bytemap[c]) {
+                continue;
+            }
+            auto refined = ca_.get_byte_class(static_cast<uint8_t>(i));
+            if (std::find(literal_classes_.begin(), literal_classes_.end(), refined)
+                    == literal_classes_.end()) {
+                literal_classes_.push_back(refined);
+            }
+        }
+        return literal_classes_;
+    }
+
     Fragment Builder::lit_frag(re2::Regexp *re, CounterId cnt) {
         char chars[re2::UTFmax];
         int rune = re->rune();
         int len = re2::runetochar(chars, &rune);
-        if (len == 1) {
+        Fragment frag{{}, {}, false, NoAnchor};
+        StateId prev = InitState;
+        for (auto i = 0; i < len; i++) {
             auto s = ca_.add_state(cnt);
-            return Fragment{{FirstState{s, ca_.get_byte_class(chars[0])}}, {s}, false, NoAnchor};
-        } else {
-            Fragment frag{{}, {}, false, NoAnchor};
-            StateId prev;
-            for (auto i = 0; i < len; i++) {
-                auto s = ca_.add_state(cnt);
+            for (auto c : literal_classes(chars[i])) {
                 if (i == 0) {
-                    frag.first.push_back(FirstState{s, ca_.get_byte_class(chars[i])});
+                    frag.first.push_back(FirstState{s, c});
                 } else {
-                    add_transition(prev, s, ca_.get_byte_class(chars[i]));
+                    add_transition(prev, s, c);
                 }
-                if (i == len - 1) {
-                    frag.last.push_back(s);
-                }
-                prev = s;
             }
-            return frag;
+            prev = s;
         }
+        frag.last.push_back(prev);
+        return frag;
     }
 
     Fragment Builder::lit_str_frag(re2::Regexp *re, CounterId cnt) {
@@ -272,7 +351,7 @@ namespace CA::glushkov {
         Fragment frag{{}, {}, false, NoAnchor};
         char chars[re2::UTFmax * re->nrunes()];
         int base = 0;
-        StateId prev;
+        StateId prev = InitState;
         for (auto i = 0; i < re->nrunes(); ++i) {
             int rune = re->runes()[i];
             int len = re2::runetochar(chars + base, &rune);
@@ -281,10 +360,12 @@ namespace CA::glushkov {
             }
             for (auto j = 0; j < len; j++) {
                 auto s = ca_.add_state(cnt);
-                if (i == 0 && j == 0) {
-                    frag.first.push_back(FirstState{s, ca_.get_byte_class(chars[0])});
-                } else {
-                    add_transition(prev, s, ca_.get_byte_class(chars[base + j]));
+                for (auto c : literal_classes(chars[base + j])) {
+                    if (i == 0 && j == 0) {
+                        frag.first.push_back(FirstState{s, c});
+                    } else {
+                        add_transition(prev, s, c);
+                    }
                 }
                 prev = s;
             }
@@ -322,10 +403,10 @@ namespace CA::glushkov {
                 }
                 if (sub_frag.anchor_flag & EndAnchor) {
                     if (front_anchor && i == 1) {
-                        ca_.get_init().set_final(ca_.get_counters());
+                        set_init_final(true);
                     }
                     for (auto const& last : frag.last) {
-                        ca_.get_state(last).set_final(ca_.get_counters());
+                        ca_.get_state(last).set_final(ca_.get_counters(), true);
                     }
                     if (sub_frag.anchor_flag & NoEndAlter) {
                         // TODO: check if this is correct
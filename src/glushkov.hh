@@ -4,6 +4,7 @@
 #include <string>
 #include <string_view>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <unordered_map>
 
@@ -39,14 +40,42 @@ namespace CA::glushkov {
         uint8_t anchor_flag;
     };
 
+    // marks the states shared by the patterns of a set
+    const unsigned SharedState = ~0u;
+
+    // maps the final states of a CA built from a set of patterns to the
+    // indexes of the patterns
+    struct PatternTags {
+        PatternTags() : state_pattern(), init_patterns(), loop_patterns() {}
+
+        // pattern owning each CA state or SharedState
+        std::vector<unsigned> state_pattern;
+        // patterns that make the initial state final
+        std::vector<unsigned> init_patterns;
+        // nullable unanchored patterns that make any_loop_start final
+        std::vector<unsigned> loop_patterns;
+    };
+
     class Builder {
         public:
         static CA get_ca(std::string_view pattern) {
-            auto builder = Builder(pattern);
+            auto builder = Builder(std::vector<std::string_view>{pattern});
+            return builder.ca();
+        }
+
+        // CA of the union of the patterns using one bytemap refining the
+        // bytemaps of all the patterns
+        static CA get_set_ca(std::vector<std::string_view> const& patterns, PatternTags& tags) {
+            auto builder = Builder(patterns);
+            tags = builder.tags();
             return builder.ca();
         }
 
         private:
+        void set_bytemap();
+        void add_pattern(unsigned id, re2::Regexp *re);
+        void set_init_final(bool end_only = false);
+
         void add_transition(StateId o_id, StateId t_id, Symbol symbol);
         // used when the star repetition({0, -1}) is outside the scope of any counter
         void add_transition_star(StateId o_id, StateId t_id, Symbol symbol);
@@ -58,6 +87,10 @@ namespace CA::glushkov {
         Fragment compute_fragment(re2::Regexp *re, CounterId cnt);
         
         Fragment get_range_frag(CounterId cnt);
+        // byte classes of the CA matched by a literal byte of the pattern
+        // being built: the classes refining the class of the byte in the
+        // bytemap of the pattern, which holds both cases of a folded letter
+        std::vector<Symbol> const& literal_classes(char byte);
 
         // concrete implementattions for each type of regexp
         Fragment lit_frag(re2::Regexp *re, CounterId cnt);
@@ -74,12 +107,16 @@ namespace CA::glushkov {
         Fragment char_class_frag(re2::Regexp *re, CounterId cnt);
 
         CA ca() { return std::move(ca_); }
-        Builder(std::string_view pattern);
+        PatternTags tags() { return std::move(tags_); }
+        Builder(std::vector<std::string_view> const& patterns);
 
 
-        re2::regex::Regex regex_;
+        std::vector<std::unique_ptr<re2::regex::Regex>> regexes_;
         CA ca_;
+        PatternTags tags_;
+        unsigned pattern_; // pattern being built
         re2::range_builder::Builder range_builder_;
         std::vector<StateId> range_states_; // used by charclass construction
+        std::vector<Symbol> literal_classes_; // used by literal construction
     };
 } // namespace CA::glushkov
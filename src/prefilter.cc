@@ -0,0 +1,328 @@
+#include "prefilter.hh"
+#include "regex.hh"
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+
+namespace CSA {
+
+using namespace std;
+
+namespace {
+
+const size_t max_exact_strings = 16;
+
+// If exact, strings are all the strings matched by the regexp. Otherwise
+// at least one of strings occurs in every match, empty means no literal
+// is required.
+struct LiteralInfo {
+    bool exact;
+    vector<string> strings;
+};
+
+LiteralInfo any_info() { return LiteralInfo{false, {}}; }
+
+LiteralInfo exact_info(vector<string>&& strings) {
+    sort(strings.begin(), strings.end());
+    strings.erase(unique(strings.begin(), strings.end()), strings.end());
+    return LiteralInfo{true, std::move(strings)};
+}
+
+vector<string> required(LiteralInfo const& info) {
+    if (info.exact && any_of(info.strings.begin(), info.strings.end(),
+                [] (string const& str) { return str.empty(); })) {
+        return {};
+    }
+    return info.strings;
+}
+
+size_t score(vector<string> const& strings) {
+    size_t min = 0;
+    for (auto const& str : strings) {
+        if (min == 0 || str.size() < min) {
+            min = str.size();
+        }
+    }
+    return min;
+}
+
+vector<string> better(vector<string>&& a, vector<string>&& b) {
+    auto sa = score(a);
+    auto sb = score(b);
+    if (sa > sb || (sa == sb && !a.empty() && a.size() <= b.size())) {
+        return std::move(a);
+    }
+    return std::move(b);
+}
+
+vector<string> cross(vector<string> const& a, vector<string> const& b) {
+    vector<string> res;
+    res.reserve(a.size() * b.size());
+    for (auto const& x : a) {
+        for (auto const& y : b) {
+            res.push_back(x + y);
+        }
+    }
+    return res;
+}
+
+string rune_to_utf8(re2::Rune rune) {
+    char chars[re2::UTFmax];
+    int len = re2::runetochar(chars, &rune);
+    return string(chars, len);
+}
+
+LiteralInfo rune_info(re2::Rune rune, bool fold_case) {
+    if (!fold_case) {
+        return exact_info({rune_to_utf8(rune)});
+    }
+    if (rune >= 0x80) {
+        return any_info();
+    }
+    char c = static_cast<char>(rune);
+    if (c >= 'a' && c <= 'z') {
+        return exact_info({string(1, c), string(1, c - 'a' + 'A')});
+    } else if (c >= 'A' && c <= 'Z') {
+        return exact_info({string(1, c), string(1, c - 'A' + 'a')});
+    }
+    return exact_info({string(1, c)});
+}
+
+LiteralInfo concat_info(vector<LiteralInfo>&& subs) {
+    LiteralInfo acc = exact_info({""s});
+    vector<string> best;
+    bool all_exact = true;
+    for (auto& info : subs) {
+        if (acc.exact && info.exact
+                && acc.strings.size() * info.strings.size() <= max_exact_strings) {
+            acc = exact_info(cross(acc.strings, info.strings));
+            continue;
+        }
+        all_exact = false;
+        if (acc.exact) {
+            best = better(std::move(best), required(acc));
+        }
+        if (info.exact) {
+            acc = std::move(info);
+        } else {
+            best = better(std::move(best), std::move(info.strings));
+            acc = any_info();
+        }
+    }
+    if (all_exact) {
+        return acc;
+    }
+    if (acc.exact) {
+        best = better(std::move(best), required(acc));
+    }
+    return LiteralInfo{false, std::move(best)};
+}
+
+LiteralInfo compute_info(re2::Regexp* re) {
+    bool fold_case = re->parse_flags() & re2::Regexp::FoldCase;
+    switch (re->op()) {
+        case re2::kRegexpEmptyMatch:
+        case re2::kRegexpBeginLine:
+        case re2::kRegexpEndLine:
+        case re2::kRegexpBeginText:
+        case re2::kRegexpEndText:
+        case re2::kRegexpWordBoundary:
+        case re2::kRegexpNoWordBoundary:
+            return exact_info({""s});
+        case re2::kRegexpLiteral:
+            return rune_info(re->rune(), fold_case);
+        case re2::kRegexpLiteralString:
+        {
+            vector<LiteralInfo> runes;
+            for (int i = 0; i < re->nrunes(); ++i) {
+                runes.push_back(rune_info(re->runes()[i], fold_case));
+            }
+            return concat_info(std::move(runes));
+        }
+        case re2::kRegexpConcat:
+        {
+            vector<LiteralInfo> subs;
+            for (int i = 0; i < re->nsub(); ++i) {
+                subs.push_back(compute_info(re->sub()[i]));
+            }
+            return concat_info(std::move(subs));
+        }
+        case re2::kRegexpAlternate:
+        {
+            vector<LiteralInfo> subs;
+            bool all_exact = true;
+            size_t total = 0;
+            for (int i = 0; i < re->nsub(); ++i) {
+                subs.push_back(compute_info(re->sub()[i]));
+                all_exact = all_exact && subs.back().exact;
+                total += subs.back().strings.size();
+            }
+            vector<string> strings;
+            if (all_exact && total <= max_exact_strings) {
+                for (auto& info : subs) {
+                    strings.insert(strings.end(), info.strings.begin(), info.strings.end());
+                }
+                return exact_info(std::move(strings));
+            }
+            for (auto& info : subs) {
+                auto req = required(info);
+                if (req.empty()) {
+                    return any_info();
+                }
+                strings.insert(strings.end(), req.begin(), req.end());
+            }
+            return LiteralInfo{false, std::move(strings)};
+        }
+        case re2::kRegexpCapture:
+            return compute_info(re->sub()[0]);
+        case re2::kRegexpPlus:
+            return LiteralInfo{false, required(compute_info(re->sub()[0]))};
+        case re2::kRegexpRepeat:
+        {
+            if (re->min() == 0) {
+                return any_info();
+            }
+            auto sub = compute_info(re->sub()[0]);
+            if (!sub.exact) {
+                return LiteralInfo{false, std::move(sub.strings)};
+            }
+            // the first min repetitions are required, up to a limit
+            LiteralInfo acc = sub;
+            for (int i = 1; i < std::min(re->min(), 8)
+                    && acc.strings.size() * sub.strings.size() <= max_exact_strings; ++i) {
+                acc = exact_info(cross(acc.strings, sub.strings));
+            }
+            return LiteralInfo{false, required(acc)};
+        }
+        case re2::kRegexpCharClass:
+        {
+            auto cc = re->cc();
+            if (cc->size() > 4) {
+                return any_info();
+            }
+            vector<string> strings;
+            for (auto it = cc->begin(); it != cc->end(); ++it) {
+                for (auto rune = it->lo; rune <= it->hi; ++rune) {
+                    strings.push_back(rune_to_utf8(rune));
+                }
+            }
+            return exact_info(std::move(strings));
+        }
+        default: // Star, Quest, AnyChar, AnyByte, NoMatch, ...
+            return any_info();
+    }
+}
+
+} // namespace
+
+void LiteralMatcher::add(string_view literal, unsigned id) {
+    uint32_t node = 0;
+    for (char c : literal) {
+        uint8_t byte = static_cast<uint8_t>(c);
+        auto& next = nodes_[node].next;
+        auto it = lower_bound(next.begin(), next.end(), make_pair(byte, 0u));
+        if (it != next.end() && it->first == byte) {
+            node = it->second;
+        } else {
+            uint32_t new_node = nodes_.size();
+            next.insert(it, make_pair(byte, new_node));
+            nodes_.emplace_back();
+            node = new_node;
+        }
+    }
+    nodes_[node].ids.push_back(id);
+}
+
+uint32_t LiteralMatcher::child(uint32_t node, uint8_t byte) const {
+    auto const& next = nodes_[node].next;
+    auto it = lower_bound(next.begin(), next.end(), make_pair(byte, 0u));
+    if (it != next.end() && it->first == byte) {
+        return it->second;
+    }
+    return 0;
+}
+
+void LiteralMatcher::build() {
+    // breadth first so the fail links of shorter prefixes are known
+    deque<uint32_t> queue;
+    for (auto [byte, node] : nodes_[0].next) {
+        (void)byte;
+        queue.push_back(node);
+    }
+    while (!queue.empty()) {
+        uint32_t node = queue.front();
+        queue.pop_front();
+        for (auto [byte, target] : nodes_[node].next) {
+            uint32_t fail = nodes_[node].fail;
+            uint32_t next;
+            while ((next = child(fail, byte)) == 0 && fail != 0) {
+                fail = nodes_[fail].fail;
+            }
+            nodes_[target].fail = next;
+            nodes_[target].output_link = nodes_[next].ids.empty() ? nodes_[next].output_link : next;
+            queue.push_back(target);
+        }
+    }
+}
+
+Prefilter::Prefilter(vector<string> const& patterns, size_t min_literal_len)
+    : literals_(), literal_patterns_(), unfiltered_(), seen_(patterns.size(), 0), stamp_(0) {
+    unordered_map<string, unsigned> literal_ids;
+    for (unsigned i = 0; i < patterns.size(); ++i) {
+        re2::regex::Regex regex(patterns[i]);
+        auto strings = required(compute_info(regex.regexp()));
+        if (strings.empty() || score(strings) < min_literal_len) {
+            unfiltered_.push_back(i);
+            continue;
+        }
+        for (auto const& str : strings) {
+            auto [it, inserted] = literal_ids.try_emplace(str, literal_patterns_.size());
+            if (inserted) {
+                literals_.add(str, it->second);
+                literal_patterns_.emplace_back();
+            }
+            auto& ids = literal_patterns_[it->second];
+            if (ids.empty() || ids.back() != i) {
+                ids.push_back(i);
+            }
+        }
+    }
+    literals_.build();
+}
+
+void Prefilter::candidates(string_view text, vector<unsigned>& ids) {
+    ids = unfiltered_;
+    if (++stamp_ == 0) {
+        fill(seen_.begin(), seen_.end(), 0);
+        stamp_ = 1;
+    }
+    literals_.scan(text, [&] (unsigned literal) {
+        for (auto pattern : literal_patterns_[literal]) {
+            if (seen_[pattern] != stamp_) {
+                seen_[pattern] = stamp_;
+                ids.push_back(pattern);
+            }
+        }
+    });
+    sort(ids.begin(), ids.end());
+}
+
+FilteredSet::FilteredSet(vector<string> const& patterns, size_t min_literal_len)
+    : matchers_(), prefilter_(patterns, min_literal_len), candidates_() {
+    for (auto const& pattern : patterns) {
+        matchers_.push_back(make_unique<Matcher>(pattern));
+    }
+}
+
+void FilteredSet::match(string_view text, vector<unsigned>& ids) {
+    ids.clear();
+    prefilter_.candidates(text, candidates_);
+    for (auto id : candidates_) {
+        if (matchers_[id]->match(text)) {
+            ids.push_back(id);
+        }
+    }
+}
+
+} // namespace CSA
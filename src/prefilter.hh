@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "csa.hh"
+
+namespace CSA {
+
+    // Aho-Corasick automaton reporting which of the literals occur in text
+    class LiteralMatcher {
+        public:
+        LiteralMatcher() : nodes_(1) {}
+
+        void add(std::string_view literal, unsigned id);
+        // must be called after all the literals were added
+        void build();
+        // calls found(id) for every occurrence of a literal in text
+        template<typename F>
+        void scan(std::string_view text, F found) const;
+
+        size_t size() const { return nodes_.size(); }
+
+        private:
+        struct Node {
+            std::vector<std::pair<uint8_t, uint32_t>> next{}; // sorted by byte
+            uint32_t fail = 0;
+            uint32_t output_link = 0; // next node on the fail path with ids
+            std::vector<unsigned> ids{};
+        };
+
+        uint32_t child(uint32_t node, uint8_t byte) const;
+
+        std::vector<Node> nodes_;
+    };
+
+    template<typename F>
+    void LiteralMatcher::scan(std::string_view text, F found) const {
+        uint32_t node = 0;
+        for (char c : text) {
+            uint8_t byte = static_cast<uint8_t>(c);
+            uint32_t next;
+            while ((next = child(node, byte)) == 0 && node != 0) {
+                node = nodes_[node].fail;
+            }
+            node = next;
+            for (uint32_t out = nodes_[node].ids.empty() ? nodes_[node].output_link : node;
+                    out != 0; out = nodes_[out].output_link) {
+                for (auto id : nodes_[out].ids) {
+                    found(id);
+                }
+            }
+        }
+    }
+
+    // Set level prefilter in the style of RE2's FilteredRE2. For each pattern
+    // a set of literals is extracted from its re2::Regexp such that any
+    // text matching the pattern contains at least one of them. Patterns
+    // without such literals are always candidates.
+    class Prefilter {
+        public:
+        Prefilter(std::vector<std::string> const& patterns, size_t min_literal_len = 2);
+
+        // sets ids to the sorted indexes of the patterns that can match text
+        void candidates(std::string_view text, std::vector<unsigned>& ids);
+        std::vector<unsigned> const& unfiltered() const { return unfiltered_; }
+
+        private:
+        LiteralMatcher literals_;
+        std::vector<std::vector<unsigned>> literal_patterns_;
+        std::vector<unsigned> unfiltered_;
+        std::vector<uint32_t> seen_; // stamp of the last scan per pattern
+        uint32_t stamp_;
+    };
+
+    // pattern set evaluating only the matchers of the prefilter candidates
+    class FilteredSet {
+        public:
+        FilteredSet(std::vector<std::string> const& patterns, size_t min_literal_len = 2);
+
+        // sets ids to the sorted indexes of the patterns found in text
+        void match(std::string_view text, std::vector<unsigned>& ids);
+        size_t size() const { return matchers_.size(); }
+
+        private:
+        std::vector<std::unique_ptr<Matcher>> matchers_;
+        Prefilter prefilter_;
+        std::vector<unsigned> candidates_;
+    };
+
+} // namespace CSA
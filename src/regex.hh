@@ -29,6 +29,7 @@ namespace re2::regex {
 
             prog_ = regexp_->CompileToProg(options_.max_mem() * 2 / 3);
             if (prog_ == nullptr) {
+                regexp_->Decref();
                 FATAL_ERROR("Building of bytemap failed", CSA::Errors::FailedToParse);
             }
             cnt_id = 0;
@@ -0,0 +1,101 @@
+// Checks that matching does not touch the heap once the cache of the CSA
+// is warm, over the patterns of test_performance.py. The global allocation
+// functions are replaced to count the allocations.
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "csa.hh"
+
+static std::atomic<size_t> allocations{0};
+
+static void* counted_alloc(size_t size, size_t alignment) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    void* p = alignment <= alignof(std::max_align_t)
+        ? std::malloc(size)
+        : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size) { return counted_alloc(size, alignof(std::max_align_t)); }
+void* operator new(size_t size, std::align_val_t al) { return counted_alloc(size, static_cast<size_t>(al)); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+namespace {
+
+    struct Case {
+        std::string pattern;
+        std::string text;
+        bool expected;
+    };
+
+    std::string repeat(std::string const& s, size_t n) {
+        std::string res;
+        for (size_t i = 0; i < n; ++i) {
+            res += s;
+        }
+        return res;
+    }
+
+    std::string bounds(size_t min, size_t max) {
+        return "{" + std::to_string(min) + "," + std::to_string(max) + "}";
+    }
+
+    // the same patterns and texts as the benchmarks of test_performance.py
+    std::vector<Case> cases() {
+        std::vector<Case> res;
+        for (size_t length : {10, 100, 1000, 10000}) {
+            auto n = std::to_string(length);
+            res.push_back({"^a{" + n + "}$", repeat("a", length), true});
+            res.push_back({"^a" + bounds(length / 2, length) + "$", repeat("a", length), true});
+            res.push_back({"^a{" + n + "}b$", repeat("a", length) + "c", false});
+            res.push_back({"^(ab){" + n + "}$", repeat("ab", length), true});
+            res.push_back({"^a" + bounds(0, length * 3 / 2) + "$", repeat("a", length), true});
+        }
+        for (size_t length : {10, 100, 500}) {
+            res.push_back({"^a" + bounds(0, length) + "a" + bounds(0, length) + "$",
+                    repeat("a", length * 2), true});
+        }
+        return res;
+    }
+
+} // namespace
+
+int main() {
+    const unsigned warm_up = 2;
+    const unsigned runs = 3;
+    unsigned failed = 0;
+    for (auto const& c : cases()) {
+        CSA::Matcher matcher(c.pattern);
+        bool ok = true;
+        for (unsigned i = 0; i < warm_up; ++i) {
+            ok &= matcher.match(c.text) == c.expected;
+        }
+        size_t before = allocations.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < runs; ++i) {
+            ok &= matcher.match(c.text) == c.expected;
+        }
+        size_t allocated = allocations.load(std::memory_order_relaxed) - before;
+        if (!ok || allocated != 0) {
+            ++failed;
+            std::cerr << "FAILED " << c.pattern << ": " << (ok ? "" : "wrong result, ")
+                << allocated << " allocations in " << runs << " warm matches\n";
+        }
+    }
+    if (failed) {
+        std::cerr << failed << " patterns failed\n";
+        return 1;
+    }
+    std::cout << "no allocations in warm matches\n";
+    return 0;
+}
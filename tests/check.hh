@@ -0,0 +1,32 @@
+#pragma once
+
+// Minimal checks for the C++ tests. A failed check is reported and
+// counted, main returns test::result() so that ctest sees the failures.
+#include <iostream>
+
+namespace test {
+
+    inline unsigned failures = 0;
+
+    inline bool check(bool ok, char const* what, char const* file, int line) {
+        if (!ok) {
+            ++failures;
+            std::cerr << file << ":" << line << ": FAILED " << what << "\n";
+        }
+        return ok;
+    }
+
+    inline int result() {
+        if (failures) {
+            std::cerr << failures << " checks failed\n";
+            return 1;
+        }
+        return 0;
+    }
+
+} // namespace test
+
+// replaces the CHECK of re2/util/logging.h, so this header goes after the
+// headers pulling in re2
+#undef CHECK
+#define CHECK(cond) test::check(static_cast<bool>(cond), #cond, __FILE__, __LINE__)
@@ -0,0 +1,60 @@
+// Checks that compiling a batch of patterns reports the errors of each
+// pattern, whichever thread of the pool compiled it.
+#include <string>
+#include <vector>
+
+#include "csa_compile.hh"
+#include "check.hh"
+
+namespace {
+
+    void test_errors_per_pattern() {
+        std::vector<std::string> patterns = {"ab{2}", "(", "(a{2}){3}", "\xff", "x|y", ""};
+        for (unsigned threads : {0u, 1u, 2u, 4u, 16u}) {
+            auto results = CSA::compile_patterns(patterns, threads);
+            if (!CHECK(results.size() == patterns.size())) {
+                continue;
+            }
+            CHECK(results[0].ok() && results[0].error.empty());
+            CHECK(results[0].ok() && results[0].matcher->match("abb") && !results[0].matcher->match("ab"));
+            CHECK(!results[1].ok() && results[1].code == CSA::Errors::FailedToParse);
+            CHECK(!results[2].ok() && results[2].code == CSA::Errors::NestedRepetition);
+            CHECK(!results[3].ok() && results[3].code == CSA::Errors::FailedToParse);
+            for (size_t i : {1, 2, 3}) {
+                CHECK(!results[i].matcher && !results[i].error.empty());
+            }
+            CHECK(results[4].ok() && results[4].matcher->match("y"));
+            CHECK(results[5].ok() && results[5].matcher->match(""));
+        }
+    }
+
+    void test_errors_on_workers() {
+        // most patterns fail, so the workers throw as often as the caller
+        std::vector<std::string> patterns;
+        for (int i = 0; i < 200; ++i) {
+            patterns.push_back(i % 3 ? "(" + std::to_string(i) : "x" + std::to_string(i) + "{2}");
+        }
+        auto results = CSA::compile_patterns(patterns, 8);
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            if (i % 3) {
+                CHECK(!results[i].ok() && results[i].code == CSA::Errors::FailedToParse);
+            } else {
+                auto text = "x" + std::to_string(i) + std::to_string(i).back();
+                CHECK(results[i].ok() && results[i].matcher->match(text));
+            }
+        }
+    }
+
+    void test_empty_batch() {
+        CHECK(CSA::compile_patterns({}).empty());
+        CHECK(CSA::compile_patterns({}, 4).empty());
+    }
+
+} // namespace
+
+int main() {
+    test_errors_per_pattern();
+    test_errors_on_workers();
+    test_empty_batch();
+    return test::result();
+}
@@ -33,6 +33,40 @@ def setup_library():
         _lib.csa_free.restype = None
         _lib.csa_match_compiled.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
         _lib.csa_match_compiled.restype = ctypes.c_int
+        _lib.csa_count_compiled.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        _lib.csa_count_compiled.restype = ctypes.c_long
+        _lib.csa_set_memory_budget.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        _lib.csa_set_memory_budget.restype = None
+        _lib.csa_flushes.argtypes = [ctypes.c_void_p]
+        _lib.csa_flushes.restype = ctypes.c_long
+
+        _lib.csa_compile_cached.argtypes = [ctypes.c_char_p]
+        _lib.csa_compile_cached.restype = ctypes.c_void_p
+        _lib.csa_release_cached.argtypes = [ctypes.c_void_p]
+        _lib.csa_release_cached.restype = None
+        _lib.csa_match_cached.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        _lib.csa_match_cached.restype = ctypes.c_int
+        _lib.csa_cache_stats.argtypes = [ctypes.POINTER(ctypes.c_uint64)] * 3
+        _lib.csa_cache_stats.restype = None
+        _lib.csa_cache_set_capacity.argtypes = [ctypes.c_size_t]
+        _lib.csa_cache_set_capacity.restype = None
+        _lib.csa_cache_clear.argtypes = []
+        _lib.csa_cache_clear.restype = None
+
+        _lib.csa_program_compile.argtypes = [ctypes.c_char_p]
+        _lib.csa_program_compile.restype = ctypes.c_void_p
+        _lib.csa_program_free.argtypes = [ctypes.c_void_p]
+        _lib.csa_program_free.restype = None
+        _lib.csa_program_set_memory_budget.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        _lib.csa_program_set_memory_budget.restype = None
+        _lib.csa_program_flushes.argtypes = [ctypes.c_void_p]
+        _lib.csa_program_flushes.restype = ctypes.c_long
+        _lib.csa_scratch_alloc.argtypes = [ctypes.c_void_p]
+        _lib.csa_scratch_alloc.restype = ctypes.c_void_p
+        _lib.csa_scratch_free.argtypes = [ctypes.c_void_p]
+        _lib.csa_scratch_free.restype = None
+        _lib.csa_scan.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+        _lib.csa_scan.restype = ctypes.c_int
     else:
         # We can implement a fallback using CLI if needed, but a ctypes library is preferred for speed
         raise RuntimeError(f"Could not find {lib_path}. Please build the test library first.")
@@ -73,3 +107,106 @@ def check_match(pattern: str, text: str, expected_result: bool):
 
     actual_result = bool(result)
     assert actual_result == expected_result, f"Expected {expected_result} for pattern '{pattern}' on text '{text}', but got {actual_result}"
+
+def check_count(pattern: str, text: str, expected_count: int):
+    """
+    Checks the number of non-overlapping matches of `pattern` in `text`.
+    """
+    setup_library()
+
+    ptr = _lib.csa_compile(pattern.encode('utf-8'))
+    if not ptr:
+        raise ValueError(f"Error compiling pattern: {pattern}")
+    try:
+        result = _lib.csa_count_compiled(ptr, text.encode('utf-8'))
+    finally:
+        _lib.csa_free(ptr)
+
+    if result < 0:
+        raise ValueError(f"Error counting pattern: {pattern}")
+    assert result == expected_count, f"Expected {expected_count} matches of '{pattern}' in '{text}', but got {result}"
+
+def cache_stats():
+    """
+    Returns the (hits, misses, evictions) counters of the C API matcher cache.
+    """
+    setup_library()
+
+    hits, misses, evictions = ctypes.c_uint64(), ctypes.c_uint64(), ctypes.c_uint64()
+    _lib.csa_cache_stats(ctypes.byref(hits), ctypes.byref(misses), ctypes.byref(evictions))
+    return hits.value, misses.value, evictions.value
+
+def check_scan(pattern: str, texts, expected_results, threads: int = 4, budget: int = 0):
+    """
+    Scans the texts with one compiled program shared by threads, each
+    thread using its own scratch. Returns the number of flushes of the
+    state cache of the program under the memory budget.
+    """
+    setup_library()
+    import threading
+
+    program = _lib.csa_program_compile(pattern.encode('utf-8'))
+    if not program:
+        raise ValueError(f"Error compiling pattern: {pattern}")
+    _lib.csa_program_set_memory_budget(program, budget)
+    results = [[None] * len(texts) for _ in range(threads)]
+
+    def worker(t):
+        scratch = _lib.csa_scratch_alloc(program)
+        try:
+            for i, text in enumerate(texts):
+                data = text.encode('utf-8')
+                results[t][i] = _lib.csa_scan(program, scratch, data, len(data))
+        finally:
+            _lib.csa_scratch_free(scratch)
+
+    try:
+        workers = [threading.Thread(target=worker, args=(t,)) for t in range(threads)]
+        for w in workers:
+            w.start()
+        for w in workers:
+            w.join()
+        flushes = _lib.csa_program_flushes(program)
+    finally:
+        _lib.csa_program_free(program)
+
+    expected = [int(r) for r in expected_results]
+    for t in range(threads):
+        assert results[t] == expected, f"Thread {t} scanned {results[t]} for pattern '{pattern}', expected {expected}"
+    return flushes
+
+def check_budget(pattern: str, texts, budget: int):
+    """
+    Matches the texts with a small memory budget of the state cache and
+    checks that the results do not change. Returns the number of flushes.
+    """
+    setup_library()
+
+    ptr = _lib.csa_compile(pattern.encode('utf-8'))
+    if not ptr:
+        raise ValueError(f"Error compiling pattern: {pattern}")
+    try:
+        _lib.csa_set_memory_budget(ptr, budget)
+        for text in texts:
+            expected = _lib.csa_match(pattern.encode('utf-8'), text.encode('utf-8'))
+            actual = _lib.csa_match_compiled(ptr, text.encode('utf-8'))
+            assert actual == expected, f"Expected {expected} for pattern '{pattern}' on text '{text}' with budget {budget}, but got {actual}"
+        return _lib.csa_flushes(ptr)
+    finally:
+        _lib.csa_free(ptr)
+
+def cache_lib():
+    setup_library()
+    return _lib
+
+def run_cli(*args) -> str:
+    """
+    Runs the ca_cli executable from the build directory and returns its
+    standard output, failing on a non zero exit status.
+    """
+    cli = Path(__file__).parent.parent / "build" / "ca_cli"
+    if not cli.exists():
+        raise RuntimeError(f"Could not find {cli}. Please build the command line tool first.")
+    result = subprocess.run([str(cli), *map(str, args)], capture_output=True, text=True)
+    assert result.returncode == 0, f"ca_cli {' '.join(map(str, args))} failed: {result.stderr}"
+    return result.stdout
@@ -0,0 +1,87 @@
+// Checks that matching the whole buffer and feeding it to Matcher::feed
+// in chunks give the expected result, also when the counted repetitions
+// straddle the chunk boundaries.
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "check.hh"
+#include "csa.hh"
+
+namespace {
+
+    bool match_split(CSA::Matcher& matcher, std::string_view text, std::vector<size_t> const& splits) {
+        matcher.begin();
+        size_t pos = 0;
+        for (size_t split : splits) {
+            matcher.feed(text.substr(pos, split - pos));
+            pos = split;
+        }
+        matcher.feed(text.substr(pos));
+        CHECK(matcher.position() == text.size());
+        return matcher.finish();
+    }
+
+    void test_splits() {
+        struct Case { char const* pattern; std::string text; bool expected; };
+        std::vector<Case> cases = {
+            {"^a{5}$", "aaaaa", true},
+            {"^a{5}$", "aaaaaa", false},
+            {"^a{3,6}b$", "aaaab", true},
+            {"^a{3,6}b$", "aab", false},
+            {"x(ab){3}y", "--xabababy--", true},
+            {"x(ab){3}y", "--xababy--", false},
+            {"\\d{3}-\\d{4}", "call 555-1234", true},
+            {"\\d{3}-\\d{4}", "call 555-123", false},
+            {"^a{0,8}a{0,8}$", std::string(16, 'a'), true},
+            {"^a{0,8}a{0,8}$", std::string(17, 'a'), false},
+            {"[ab]{2,4}c", "xxabbac", true},
+            {"[ab]{2,4}c", "xxabbabc", true},
+            {"[ab]{2,4}c", "xxab-bc", false},
+        };
+        for (auto const& c : cases) {
+            CSA::Matcher matcher(c.pattern);
+            bool expected = c.expected;
+            if (!CHECK(matcher.match(c.text) == expected)) {
+                std::cerr << "  pattern " << c.pattern << ", whole buffer\n";
+            }
+            // every single split and every split into 1, 2 and 3 byte chunks
+            for (size_t split = 0; split <= c.text.size(); ++split) {
+                if (!CHECK(match_split(matcher, c.text, {split}) == expected)) {
+                    std::cerr << "  pattern " << c.pattern << ", split at " << split << "\n";
+                }
+            }
+            for (size_t chunk : {1, 2, 3}) {
+                std::vector<size_t> splits;
+                for (size_t pos = chunk; pos < c.text.size(); pos += chunk) {
+                    splits.push_back(pos);
+                }
+                if (!CHECK(match_split(matcher, c.text, splits) == expected)) {
+                    std::cerr << "  pattern " << c.pattern << ", chunks of " << chunk << "\n";
+                }
+            }
+        }
+    }
+
+    void test_dead_input() {
+        CSA::Matcher matcher("^ab");
+        matcher.begin();
+        CHECK(!matcher.feed("x"));
+        // the input is still counted after the config died
+        CHECK(!matcher.feed("ab"));
+        CHECK(matcher.position() == 3);
+        CHECK(!matcher.finish());
+        // finish resets the matcher
+        matcher.begin();
+        CHECK(matcher.feed("a"));
+        CHECK(matcher.feed("b"));
+        CHECK(matcher.finish());
+    }
+
+} // namespace
+
+int main() {
+    test_splits();
+    test_dead_input();
+    return test::result();
+}
@@ -0,0 +1,101 @@
+// Checks that flows scanned by one matcher in interleaved chunks, saved
+// and resumed between the chunks, give the results of matching each flow
+// as a whole, also when the cache of the CSA is flushed in between.
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "check.hh"
+#include "csa.hh"
+
+namespace {
+
+    // scans the texts as flows, chunk bytes of each flow in turn
+    std::vector<bool> scan_flows(CSA::Matcher& matcher, std::vector<std::string> const& texts, size_t chunk) {
+        std::vector<CSA::FlowState> flows(texts.size());
+        bool left = true;
+        for (size_t pos = 0; left; pos += chunk) {
+            left = false;
+            for (size_t i = 0; i < texts.size(); ++i) {
+                if (pos >= texts[i].size()) {
+                    continue;
+                }
+                matcher.resume(flows[i]);
+                CHECK(matcher.position() == pos);
+                matcher.feed(std::string_view(texts[i]).substr(pos, chunk));
+                matcher.save(flows[i]);
+                CHECK(flows[i].position() == std::min(pos + chunk, texts[i].size()));
+                CHECK(flows[i].memory() >= sizeof(CSA::FlowState));
+                left = true;
+            }
+        }
+        std::vector<bool> results;
+        for (auto const& flow : flows) {
+            matcher.resume(flow);
+            results.push_back(matcher.finish());
+        }
+        return results;
+    }
+
+    std::vector<std::string> texts() {
+        return {
+            "xx" + std::string(12, 'a') + "byy",
+            "xx" + std::string(15, 'a') + "byy",
+            std::string(5, 'a') + "b",
+            "zzzz" + std::string(40, 'c'),
+            "",
+            "aaaaaaab" + std::string(9, 'a') + "b",
+        };
+    }
+
+    void test_round_trip() {
+        for (char const* pattern : {"a{10,14}b", "^a{3,6}b", "a{2,4}b$", "c{20}"}) {
+            CSA::Matcher matcher(pattern);
+            std::vector<bool> expected;
+            for (auto const& text : texts()) {
+                expected.push_back(matcher.match(text));
+            }
+            for (size_t chunk : {1, 3, 8, 100}) {
+                if (!CHECK(scan_flows(matcher, texts(), chunk) == expected)) {
+                    std::cerr << "  pattern " << pattern << ", chunks of " << chunk << "\n";
+                }
+            }
+        }
+    }
+
+    void test_across_flush() {
+        for (char const* pattern : {"a{10,14}b", "(a|b){2,9}b", "c{20}"}) {
+            CSA::Matcher reference(pattern);
+            std::vector<bool> expected;
+            for (auto const& text : texts()) {
+                expected.push_back(reference.match(text));
+            }
+            CSA::Matcher matcher(pattern);
+            // every new transition flushes the cache
+            matcher.csa().set_memory_budget(1);
+            CHECK(scan_flows(matcher, texts(), 2) == expected);
+            CHECK(matcher.csa().flushes() > 0);
+        }
+    }
+
+    void test_not_started() {
+        CSA::Matcher matcher("ab");
+        CSA::FlowState flow;
+        CHECK(!flow.started());
+        CHECK(flow.position() == 0);
+        matcher.begin();
+        matcher.feed("xa");
+        matcher.resume(flow);
+        CHECK(matcher.position() == 0);
+        matcher.feed("ab");
+        CHECK(matcher.finish());
+    }
+
+} // namespace
+
+int main() {
+    test_round_trip();
+    test_across_flush();
+    test_not_started();
+    return test::result();
+}
@@ -0,0 +1,81 @@
+// Checks that the parallel matcher agrees with Matcher on random texts,
+// for every number of threads and with chunks small enough to split the
+// counted repetitions, reusing each matcher for many texts, also when the
+// shared cache is flushed under the threads.
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.hh"
+#include "csa.hh"
+#include "csa_parallel.hh"
+
+namespace {
+
+    std::string random_text(std::mt19937& rng) {
+        static char const alphabet[] = "abcx-01";
+        std::uniform_int_distribution<size_t> length(0, 300);
+        std::uniform_int_distribution<size_t> letter(0, sizeof(alphabet) - 2);
+        std::string text(length(rng), ' ');
+        for (auto& c : text) {
+            c = alphabet[letter(rng)];
+        }
+        return text;
+    }
+
+    void test_random() {
+        std::mt19937 rng(30);
+        for (char const* pattern : {"a{3,5}b", "(ab){2,4}c", "x[ab]{4}x", "0{2}-1{2}",
+                                    "^a[^x]{5}", "c{6}$", "(a|b)*c{3}", "b-{1,3}a"}) {
+            CSA::Matcher reference(pattern);
+            for (unsigned threads = 1; threads <= 8; ++threads) {
+                CSA::ParallelMatcher matcher(pattern, threads);
+                matcher.set_min_chunk_size(4);
+                for (int i = 0; i < 40; ++i) {
+                    auto text = random_text(rng);
+                    if (!CHECK(matcher.match(text) == reference.match(text))) {
+                        std::cerr << "  pattern " << pattern << ", " << threads << " threads, text "
+                                  << text << "\n";
+                    }
+                }
+            }
+        }
+    }
+
+    void test_memory_budget() {
+        std::mt19937 rng(41);
+        for (char const* pattern : {"(ab){2,4}c", "(a|b)*c{3}", "a[^x]{40}b"}) {
+            CSA::Matcher reference(pattern);
+            CSA::ParallelMatcher matcher(pattern, 4);
+            matcher.set_min_chunk_size(4);
+            // every new transition flushes the cache
+            matcher.csa().set_memory_budget(1);
+            for (int i = 0; i < 40; ++i) {
+                auto text = random_text(rng);
+                if (!CHECK(matcher.match(text) == reference.match(text))) {
+                    std::cerr << "  pattern " << pattern << ", text " << text << "\n";
+                }
+            }
+            CHECK(matcher.csa().flushes() > 0);
+        }
+    }
+
+    void test_short_text() {
+        CSA::ParallelMatcher matcher("ab{2}", 4);
+        // shorter than the minimal chunk, matched sequentially
+        CHECK(matcher.match("xabb"));
+        CHECK(!matcher.match("xab"));
+        matcher.set_min_chunk_size(1);
+        CHECK(matcher.match("xabb"));
+        CHECK(!matcher.match("xab"));
+        CHECK(!matcher.match(""));
+    }
+
+} // namespace
+
+int main() {
+    test_random();
+    test_memory_budget();
+    test_short_text();
+    return test::result();
+}
@@ -0,0 +1,107 @@
+// Checks the literal matcher on overlapping literals and that the
+// prefilter never drops a pattern matching the text, with case folding and
+// with patterns requiring no literal.
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "csa.hh"
+#include "prefilter.hh"
+#include "check.hh"
+
+namespace {
+
+    std::vector<unsigned> scan_ids(std::vector<std::string> const& literals, std::string const& text) {
+        CSA::LiteralMatcher matcher;
+        for (unsigned i = 0; i < literals.size(); ++i) {
+            matcher.add(literals[i], i);
+        }
+        matcher.build();
+        std::vector<unsigned> ids;
+        matcher.scan(text, [&](unsigned id) { ids.push_back(id); });
+        return ids;
+    }
+
+    void test_overlapping_literals() {
+        std::vector<std::string> literals = {"he", "she", "his", "hers"};
+        // "she" and "he" end at the same byte, "hers" starts inside "she"
+        CHECK((scan_ids(literals, "ushers") == std::vector<unsigned>{1, 0, 3}));
+        CHECK((scan_ids(literals, "hishe") == std::vector<unsigned>{2, 1, 0}));
+        CHECK(scan_ids(literals, "hhss").empty());
+        // every occurrence is reported, also of literals inside each other
+        auto ids = scan_ids({"a", "aa", "aaa"}, "aaaa");
+        CHECK(std::count(ids.begin(), ids.end(), 0u) == 4);
+        CHECK(std::count(ids.begin(), ids.end(), 1u) == 3);
+        CHECK(std::count(ids.begin(), ids.end(), 2u) == 2);
+        // the same literal added for two ids
+        CHECK((scan_ids({"ab", "ab"}, "xab") == std::vector<unsigned>{0, 1}));
+    }
+
+    std::vector<unsigned> expected_ids(std::vector<std::string> const& patterns, std::string const& text) {
+        std::vector<unsigned> ids;
+        for (unsigned i = 0; i < patterns.size(); ++i) {
+            if (CSA::Matcher(patterns[i]).match(text)) {
+                ids.push_back(i);
+            }
+        }
+        return ids;
+    }
+
+    void check_filtered(std::vector<std::string> const& patterns, std::vector<std::string> const& texts) {
+        CSA::FilteredSet set(patterns);
+        std::vector<unsigned> ids;
+        for (auto const& text : texts) {
+            set.match(text, ids);
+            if (!CHECK(ids == expected_ids(patterns, text))) {
+                std::cerr << "  text " << text << "\n";
+            }
+        }
+    }
+
+    void test_fold_case() {
+        CSA::Prefilter prefilter({"(?i)hello", "hello", "(?i)ab{2}c"});
+        CHECK(prefilter.unfiltered().empty());
+        std::vector<unsigned> ids;
+        prefilter.candidates("say HeLLo", ids);
+        CHECK((ids == std::vector<unsigned>{0}));
+        prefilter.candidates("hello ABBC", ids);
+        CHECK((ids == std::vector<unsigned>{0, 1, 2}));
+        prefilter.candidates("help", ids);
+        CHECK(ids.empty());
+        // k and s also fold to the Kelvin sign and the long s
+        check_filtered({"(?i)hello", "hello", "(?i)ab{2}c", "(?i)x[yz]{2}", "(?i)ok", "(?i)os"},
+                       {"HELLO", "hello", "hElLo", "aBbC", "abc", "XyZ", "xYq", "", "o\u212A", "O\u017F"});
+    }
+
+    void test_no_required_literal() {
+        std::vector<std::string> patterns = {"a*", "[a-z]+", "x|yz", "(ab)?c", "\\d{3}", "q.*r", "abc"};
+        CSA::Prefilter prefilter(patterns);
+        // only "abc" requires a literal of at least two bytes
+        CHECK((prefilter.unfiltered() == std::vector<unsigned>{0, 1, 2, 3, 4, 5}));
+        std::vector<unsigned> ids;
+        prefilter.candidates("", ids);
+        CHECK((ids == std::vector<unsigned>{0, 1, 2, 3, 4, 5}));
+        prefilter.candidates("xabcx", ids);
+        CHECK((ids == std::vector<unsigned>{0, 1, 2, 3, 4, 5, 6}));
+        check_filtered(patterns, {"", "x", "yz", "c", "123", "q--r", "abc", "ABC"});
+    }
+
+    void test_min_literal_len() {
+        CSA::Prefilter prefilter({"ab", "abcd"}, 3);
+        CHECK((prefilter.unfiltered() == std::vector<unsigned>{0}));
+        std::vector<unsigned> ids;
+        prefilter.candidates("xabcdx", ids);
+        CHECK((ids == std::vector<unsigned>{0, 1}));
+        prefilter.candidates("xabx", ids);
+        CHECK((ids == std::vector<unsigned>{0}));
+    }
+
+} // namespace
+
+int main() {
+    test_overlapping_literals();
+    test_fold_case();
+    test_no_required_literal();
+    test_min_literal_len();
+    return test::result();
+}
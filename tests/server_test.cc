@@ -0,0 +1,256 @@
+// Checks the replies of the server to well formed and malformed requests,
+// concurrent clients (also with a memory budget that flushes the shared
+// caches), the eviction of the least recently used patterns and that
+// stopping the server closes the connections.
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "csa_server.hh"
+#include "check.hh"
+
+namespace {
+
+    using Op = CSA::Server::Op;
+
+    void append_u32(std::string& out, uint32_t val) {
+        for (int i = 0; i < 4; ++i) {
+            out.push_back(static_cast<char>(val >> (8 * i)));
+        }
+    }
+
+    uint64_t load(std::string const& data, size_t pos, int bytes) {
+        uint64_t val = 0;
+        for (int i = bytes - 1; i >= 0; --i) {
+            val = (val << 8) | static_cast<uint8_t>(data[pos + i]);
+        }
+        return val;
+    }
+
+    struct Reply {
+        bool closed = false;
+        uint8_t status = 0;
+        std::string body{};
+    };
+
+    class Client {
+        public:
+        Client(std::string const& path) : fd_(socket(AF_UNIX, SOCK_STREAM, 0)) {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+            CHECK(connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        }
+        Client(Client const&) = delete;
+        Client& operator=(Client const&) = delete;
+        ~Client() { close(fd_); }
+
+        void send_raw(std::string const& data) {
+            CHECK(write(fd_, data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+        }
+
+        Reply request(Op op, std::string const& body) {
+            std::string frame;
+            append_u32(frame, body.size() + 1);
+            frame.push_back(static_cast<char>(op));
+            send_raw(frame + body);
+            return receive();
+        }
+
+        Reply receive() {
+            Reply reply;
+            std::string header = read_n(4);
+            if (header.size() < 4) {
+                reply.closed = true;
+                return reply;
+            }
+            std::string frame = read_n(load(header, 0, 4));
+            reply.status = static_cast<uint8_t>(frame[0]);
+            reply.body = frame.substr(1);
+            return reply;
+        }
+
+        uint32_t compile(std::string const& pattern) {
+            auto reply = request(Op::Compile, pattern);
+            CHECK(reply.status == 0 && reply.body.size() == 4);
+            return load(reply.body, 0, 4);
+        }
+
+        static std::string buffers(uint32_t id, std::vector<std::string> const& bufs) {
+            std::string body;
+            append_u32(body, id);
+            append_u32(body, bufs.size());
+            for (auto const& buf : bufs) {
+                append_u32(body, buf.size());
+                body += buf;
+            }
+            return body;
+        }
+
+        std::vector<uint64_t> run(Op op, uint32_t id, std::vector<std::string> const& bufs) {
+            auto reply = request(op, buffers(id, bufs));
+            std::vector<uint64_t> res;
+            if (!CHECK(reply.status == 0)) {
+                return res;
+            }
+            int width = op == Op::Match ? 1 : 8;
+            for (size_t i = 0; i < load(reply.body, 0, 4); ++i) {
+                res.push_back(load(reply.body, 4 + i * width, width));
+            }
+            return res;
+        }
+
+        private:
+        std::string read_n(size_t size) {
+            std::string data(size, '\0');
+            size_t done = 0;
+            while (done < size) {
+                ssize_t res = read(fd_, data.data() + done, size - done);
+                if (res <= 0) {
+                    break;
+                }
+                done += res;
+            }
+            data.resize(done);
+            return data;
+        }
+
+        int fd_;
+    };
+
+    // runs the server in a thread for the duration of a test
+    class Running {
+        public:
+        Running(std::string const& path, size_t max_programs = 1024, size_t memory_budget = 0)
+            : server(path, max_programs, memory_budget), thread([this] { server.run(); }) {}
+        Running(Running const&) = delete;
+        Running& operator=(Running const&) = delete;
+        ~Running() {
+            server.stop();
+            thread.join();
+        }
+
+        CSA::Server server;
+        std::thread thread;
+    };
+
+    std::string socket_path(char const* test) {
+        return "/tmp/csa_server_test_" + std::to_string(getpid()) + "_" + test;
+    }
+
+    void test_requests() {
+        auto path = socket_path("requests");
+        Running running(path);
+        Client client(path);
+        auto id = client.compile("a{2,3}b");
+        CHECK(client.compile("a{2,3}b") == id);
+        CHECK(client.compile("x") != id);
+        CHECK((client.run(Op::Match, id, {"aab", "ab", "", "xaaaab"}) == std::vector<uint64_t>{1, 0, 0, 1}));
+        CHECK((client.run(Op::Count, id, {"aab aaab", "b"}) == std::vector<uint64_t>{2, 0}));
+        CHECK(client.run(Op::Match, id, {}).empty());
+
+        auto error = client.request(Op::Compile, "(");
+        CHECK(error.status == static_cast<uint8_t>(CSA::Errors::FailedToParse) && !error.body.empty());
+        auto unknown = client.request(Op::Match, Client::buffers(12345, {"a"}));
+        CHECK(unknown.status == CSA::Server::bad_request);
+        auto bad_op = client.request(static_cast<Op>(9), "");
+        CHECK(bad_op.status == CSA::Server::bad_request);
+        auto truncated = Client::buffers(id, {"aab"});
+        truncated.pop_back();
+        CHECK(client.request(Op::Match, truncated).status == CSA::Server::bad_request);
+        CHECK(client.request(Op::Match, Client::buffers(id, {"aab"}) + "x").status == CSA::Server::bad_request);
+        // the connection is still usable after the errors
+        CHECK((client.run(Op::Match, id, {"aab"}) == std::vector<uint64_t>{1}));
+    }
+
+    void test_bad_frame() {
+        auto path = socket_path("frame");
+        Running running(path);
+        Client client(path);
+        std::string frame;
+        append_u32(frame, CSA::Server::max_frame_size + 1);
+        client.send_raw(frame);
+        CHECK(client.receive().closed);
+        // other connections are not affected
+        Client other(path);
+        auto id = other.compile("ab");
+        CHECK((other.run(Op::Match, id, {"xab"}) == std::vector<uint64_t>{1}));
+    }
+
+    void test_concurrent_clients(size_t memory_budget) {
+        auto path = socket_path("concurrent");
+        Running running(path, 1024, memory_budget);
+        std::vector<std::thread> threads;
+        std::vector<int> ok(8, 0);
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&, t] {
+                Client client(path);
+                auto id = client.compile("(ab|ba){2,4}c");
+                bool good = true;
+                for (int i = 0; i < 50; ++i) {
+                    auto text = std::string(i % 5, 'x') + (i % 2 ? "abba" : "ab") + "c";
+                    good = good && client.run(Op::Match, id, {text}) == std::vector<uint64_t>{i % 2 ? 1u : 0u};
+                }
+                ok[t] = good;
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        CHECK((ok == std::vector<int>(8, 1)));
+        // the clients share the program of the pattern
+        CHECK(running.server.program_count() == 1);
+    }
+
+    void test_eviction() {
+        auto path = socket_path("eviction");
+        Running running(path, 2);
+        Client client(path);
+        auto a = client.compile("a");
+        auto b = client.compile("b");
+        CHECK((client.run(Op::Match, a, {"a"}) == std::vector<uint64_t>{1}));
+        // b is the least recently used
+        auto c = client.compile("c");
+        CHECK(running.server.program_count() == 2);
+        CHECK((client.run(Op::Match, a, {"a"}) == std::vector<uint64_t>{1}));
+        CHECK((client.run(Op::Match, c, {"c"}) == std::vector<uint64_t>{1}));
+        CHECK(client.request(Op::Match, Client::buffers(b, {"b"})).status == CSA::Server::bad_request);
+        // compiled again with a new id
+        auto b2 = client.compile("b");
+        CHECK(b2 != b);
+        CHECK((client.run(Op::Match, b2, {"b"}) == std::vector<uint64_t>{1}));
+        CHECK(running.server.program_count() == 2);
+    }
+
+    void test_stop() {
+        auto path = socket_path("stop");
+        {
+            Running running(path);
+            Client client(path);
+            auto id = client.compile("ab");
+            CHECK((client.run(Op::Match, id, {"ab"}) == std::vector<uint64_t>{1}));
+            running.server.stop();
+            // the open connection is closed by stop
+            CHECK(client.receive().closed);
+            CHECK(access(path.c_str(), F_OK) == 0);
+        }
+        CHECK(access(path.c_str(), F_OK) != 0);
+    }
+
+} // namespace
+
+int main() {
+    test_requests();
+    test_bad_frame();
+    test_concurrent_clients(0);
+    // every new transition flushes the cache
+    test_concurrent_clients(1);
+    test_eviction();
+    test_stop();
+    return test::result();
+}
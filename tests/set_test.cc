@@ -0,0 +1,135 @@
+// Checks that a pattern set finds the same patterns as matching each
+// pattern on its own, also when only some of the patterns fold case and
+// when patterns are added to and removed from a live set, and that a live
+// set stays usable when adding a pattern fails.
+#include <map>
+#include <string>
+#include <vector>
+
+#include "csa.hh"
+#include "csa_set.hh"
+#include "check.hh"
+
+namespace {
+
+    std::vector<unsigned> expected_ids(std::vector<std::string> const& patterns, std::string const& text) {
+        std::vector<unsigned> ids;
+        for (unsigned i = 0; i < patterns.size(); ++i) {
+            if (CSA::Matcher(patterns[i]).match(text)) {
+                ids.push_back(i);
+            }
+        }
+        return ids;
+    }
+
+    void check_set(std::vector<std::string> const& patterns, std::vector<std::string> const& texts) {
+        CSA::PatternSet set(patterns);
+        std::vector<unsigned> ids;
+        for (auto const& text : texts) {
+            set.match(text, ids);
+            if (!CHECK(ids == expected_ids(patterns, text))) {
+                std::cerr << "  text " << text << "\n";
+            }
+        }
+    }
+
+    void test_fold_case() {
+        std::vector<std::string> texts = {"HI", "hi", "Hi", "hI", "xhiy", "h", "", "ŠA", "ša", "HELLO hello"};
+        check_set({"(?i)hi", "hi"}, texts);
+        check_set({"hi", "(?i)hi"}, texts);
+        check_set({"H", "(?i)hi", "i$"}, texts);
+        check_set({"(?i)hello", "Hello", "(?i)h{2}", "ello"}, texts);
+        check_set({"(?i)h{1,2}i", "I"}, {"hhi", "HHI", "hHi", "hhI", "HI", "hhhx"});
+        check_set({"(?i)ša", "ŠA", "a"}, texts);
+    }
+
+    void test_fold_case_lines() {
+        // one of each spelling, the folded pattern finds all of them
+        CSA::PatternSet set({"(?i)hi", "hi"});
+        std::vector<unsigned> ids;
+        size_t found = 0;
+        for (std::string line : {"HI", "hi", "Hi"}) {
+            set.match(line, ids);
+            found += !ids.empty() && ids[0] == 0;
+        }
+        CHECK(found == 3);
+    }
+
+    bool add_fails(CSA::LivePatternSet& set, std::string const& pattern) {
+        try {
+            set.add(pattern);
+        } catch (CSA::Error const&) {
+            return true;
+        }
+        return false;
+    }
+
+    void test_live_failed_add() {
+        // the failing pattern would open a new shard
+        CSA::LivePatternSet set(2);
+        auto ab = set.add("ab");
+        auto cd = set.add("cd");
+        CHECK(add_fails(set, "a{100000000}("));
+        CHECK(set.size() == 2);
+        CHECK(set.shard_count() == 1);
+        std::vector<unsigned> ids;
+        set.match("xabcd", ids);
+        CHECK((ids == std::vector<unsigned>{ab, cd}));
+
+        // the failing pattern would join the newest shard
+        auto ef = set.add("ef");
+        CHECK(add_fails(set, "("));
+        CHECK(set.size() == 3);
+        CHECK(set.shard_count() == 2);
+        set.match("ef cd", ids);
+        CHECK((ids == std::vector<unsigned>{cd, ef}));
+        auto gh = set.add("gh");
+        set.match("ghab", ids);
+        CHECK((ids == std::vector<unsigned>{ab, gh}));
+    }
+
+    void test_live_add_remove() {
+        CSA::LivePatternSet set(3);
+        std::map<unsigned, std::string> live;
+        std::vector<std::string> patterns = {"a{2}", "(?i)b", "c$", "^d", "ab", "e{1,3}f", "(?i)ABC", "x"};
+        std::vector<std::string> texts = {"aa", "B", "xc", "dd", "abc", "eef", "AbC", "", "Abcx"};
+        auto check_live = [&] {
+            CHECK(set.size() == live.size());
+            std::vector<unsigned> ids;
+            for (auto const& text : texts) {
+                std::vector<unsigned> expected;
+                for (auto const& [id, pattern] : live) {
+                    if (CSA::Matcher(pattern).match(text)) {
+                        expected.push_back(id);
+                    }
+                }
+                set.match(text, ids);
+                if (!CHECK(ids == expected)) {
+                    std::cerr << "  text " << text << "\n";
+                }
+            }
+        };
+        for (auto const& pattern : patterns) {
+            live[set.add(pattern)] = pattern;
+        }
+        check_live();
+        // removing from the middle of a shard, then a whole shard
+        for (unsigned id : {1u, 4u, 3u, 5u}) {
+            CHECK(set.remove(id));
+            live.erase(id);
+            check_live();
+        }
+        CHECK(!set.remove(4));
+        live[set.add("b{2}")] = "b{2}";
+        check_live();
+    }
+
+} // namespace
+
+int main() {
+    test_fold_case();
+    test_fold_case_lines();
+    test_live_failed_add();
+    test_live_add_remove();
+    return test::result();
+}
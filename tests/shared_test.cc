@@ -0,0 +1,218 @@
+// Checks that the states of a CSA survive the round trip through its
+// image, that processes sharing a segment append and read only what the
+// others lack, and that opening a segment its creator left uninitialized
+// fails instead of waiting forever, as does one smaller than its capacity.
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "csa.hh"
+#include "csa_shared.hh"
+#include "check.hh"
+
+namespace {
+
+    char const* const pattern = "(ab|ba){2,5}c|x[ab]{3}y";
+
+    std::vector<std::string> texts() {
+        std::vector<std::string> res;
+        for (int n = 0; n < 40; ++n) {
+            res.push_back(std::string(n % 7, 'x') + (n % 2 ? "ab" : "ba") + std::string(n % 5, 'b') + "c"
+                          + std::string(n % 3, 'a') + (n % 4 ? "xaby" : "xabay"));
+        }
+        return res;
+    }
+
+    std::vector<bool> match_all(CSA::Matcher& matcher, std::vector<std::string> const& texts) {
+        std::vector<bool> results;
+        for (auto const& text : texts) {
+            results.push_back(matcher.match(text));
+        }
+        return results;
+    }
+
+    std::string segment_name(char const* test) {
+        return "/csa_shared_test_" + std::to_string(getpid()) + "_" + test;
+    }
+
+    void test_round_trip() {
+        CSA::Matcher source(pattern);
+        auto expected = match_all(source, texts());
+        auto image = CSA::SharedCache::export_image(source.csa());
+        CHECK(!image.empty());
+
+        CSA::Matcher copy(pattern);
+        CSA::SharedCache::import_image(copy.csa(), image.data(), image.size());
+        CHECK(CSA::SharedCache::export_image(copy.csa()).size() == image.size());
+        // every transition needed was imported
+        CHECK(match_all(copy, texts()) == expected);
+        CHECK(CSA::SharedCache::export_image(copy.csa()).size() == image.size());
+
+        // a truncated image is rejected
+        CSA::Matcher truncated(pattern);
+        bool thrown = false;
+        try {
+            CSA::SharedCache::import_image(truncated.csa(), image.data(), image.size() - 1);
+        } catch (CSA::Error const& err) {
+            thrown = err.code() == CSA::Errors::SharedMemory;
+        }
+        CHECK(thrown);
+    }
+
+    void test_incremental() {
+        auto name = segment_name("incremental");
+        CSA::SharedCache::remove(name);
+        CSA::Matcher a(pattern);
+        CSA::SharedCache first(name, pattern, a.csa(), 1 << 20);
+        CSA::SharedCache second(name, pattern, a.csa(), 1 << 20);
+        auto all = texts();
+        std::vector<std::string> half(all.begin(), all.begin() + all.size() / 2);
+
+        match_all(a, half);
+        CHECK(first.publish(a.csa()));
+        auto size = first.image_size();
+        CHECK(size == CSA::SharedCache::export_image(a.csa()).size());
+        // nothing new to publish or import
+        auto generation = first.generation();
+        CHECK(first.publish(a.csa()));
+        CHECK(first.generation() == generation);
+        CHECK(!first.import(a.csa()));
+
+        CSA::Matcher b(pattern);
+        CHECK(second.import(b.csa()));
+        CHECK(!second.import(b.csa()));
+        auto expected = match_all(a, all);
+        CHECK(match_all(b, all) == expected);
+        // b appends only the part a did not publish
+        CHECK(second.publish(b.csa()));
+        CHECK(second.image_size() > size);
+        CHECK(second.image_size() - size < CSA::SharedCache::export_image(b.csa()).size());
+        CHECK(first.import(a.csa()));
+
+        CSA::Matcher c(pattern);
+        CHECK(first.import(c.csa()));
+        auto exported = CSA::SharedCache::export_image(c.csa()).size();
+        CHECK(match_all(c, all) == expected);
+        CHECK(CSA::SharedCache::export_image(c.csa()).size() == exported);
+        CSA::SharedCache::remove(name);
+    }
+
+    void test_full_segment() {
+        auto name = segment_name("full");
+        CSA::SharedCache::remove(name);
+        CSA::Matcher matcher(pattern);
+        CSA::SharedCache cache(name, pattern, matcher.csa(), 64);
+        auto expected = match_all(matcher, texts());
+        CHECK(!cache.publish(matcher.csa()));
+        CHECK(cache.image_size() == 0);
+        CHECK(match_all(matcher, texts()) == expected);
+        CSA::SharedCache::remove(name);
+    }
+
+    void test_processes() {
+        auto name = segment_name("processes");
+        CSA::SharedCache::remove(name);
+        CSA::Matcher reference(pattern);
+        auto all = texts();
+        auto expected = match_all(reference, all);
+        const int workers = 4;
+        std::vector<pid_t> pids;
+        for (int w = 0; w < workers; ++w) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                // each worker matches its share of the texts twice, importing
+                // what the others published in between
+                bool ok = true;
+                try {
+                    CSA::Matcher matcher(pattern);
+                    CSA::SharedCache cache(name, pattern, matcher.csa(), 1 << 20);
+                    for (int round = 0; round < 2; ++round) {
+                        cache.import(matcher.csa());
+                        for (size_t i = w; i < all.size(); i += workers - round) {
+                            ok = ok && matcher.match(all[i]) == expected[i];
+                        }
+                        ok = ok && cache.publish(matcher.csa());
+                    }
+                } catch (...) {
+                    ok = false;
+                }
+                _exit(ok ? 0 : 1);
+            }
+            pids.push_back(pid);
+        }
+        for (auto pid : pids) {
+            int status = 0;
+            CHECK(waitpid(pid, &status, 0) == pid);
+            CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+
+        CSA::Matcher matcher(pattern);
+        CSA::SharedCache cache(name, pattern, matcher.csa(), 1 << 20);
+        CHECK(cache.generation() > 0);
+        CHECK(cache.import(matcher.csa()));
+        auto exported = CSA::SharedCache::export_image(matcher.csa()).size();
+        CHECK(match_all(matcher, all) == expected);
+        CHECK(CSA::SharedCache::export_image(matcher.csa()).size() == exported);
+        CSA::SharedCache::remove(name);
+    }
+
+    bool open_fails(std::string const& name, char const* other_pattern = pattern) {
+        try {
+            CSA::Matcher matcher(other_pattern);
+            CSA::SharedCache cache(name, other_pattern, matcher.csa(), 1 << 10);
+        } catch (CSA::Error const& err) {
+            return err.code() == CSA::Errors::SharedMemory;
+        }
+        return false;
+    }
+
+    void test_dead_creator() {
+        auto name = segment_name("dead");
+        CSA::SharedCache::remove(name);
+        // the creator died before sizing the segment
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        CHECK(fd >= 0);
+        CHECK(open_fails(name));
+        // and after sizing it, before marking it ready
+        CHECK(ftruncate(fd, 4096) == 0);
+        close(fd);
+        CHECK(open_fails(name));
+        CSA::SharedCache::remove(name);
+
+        CSA::Matcher matcher(pattern);
+        CSA::SharedCache cache(name, pattern, matcher.csa(), 1 << 10);
+        CHECK(open_fails(name, "abc"));
+        CSA::SharedCache::remove(name);
+    }
+
+    void test_shrunk_segment() {
+        auto name = segment_name("shrunk");
+        CSA::SharedCache::remove(name);
+        CSA::Matcher matcher(pattern);
+        {
+            CSA::SharedCache cache(name, pattern, matcher.csa(), 1 << 10);
+        }
+        // the header is intact but the image does not fit anymore
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        CHECK(fd >= 0);
+        CHECK(ftruncate(fd, 512) == 0);
+        close(fd);
+        CHECK(open_fails(name));
+        CSA::SharedCache::remove(name);
+    }
+
+} // namespace
+
+int main() {
+    test_round_trip();
+    test_incremental();
+    test_full_segment();
+    test_processes();
+    test_dead_creator();
+    test_shrunk_segment();
+    return test::result();
+}
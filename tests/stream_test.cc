@@ -0,0 +1,102 @@
+// Checks that the match stream reports the same match ends as
+// Matcher::matches however the input is split into chunks.
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "check.hh"
+#include "csa.hh"
+#include "csa_stream.hh"
+
+namespace {
+
+    std::vector<uint64_t> stream_ends(CSA::Matcher& matcher, std::string const& text, size_t chunk) {
+        std::vector<uint64_t> ends;
+        auto stream = CSA::stream_matches(matcher.config());
+        for (size_t pos = 0; pos < text.size(); pos += chunk) {
+            stream.feed(std::string_view(text).substr(pos, chunk));
+            while (auto end = stream.next()) {
+                ends.push_back(*end);
+            }
+        }
+        stream.close();
+        while (auto end = stream.next()) {
+            ends.push_back(*end);
+        }
+        CHECK(stream.done());
+        return ends;
+    }
+
+    std::vector<uint64_t> matcher_ends(CSA::Matcher& matcher, std::string const& text) {
+        std::vector<uint64_t> ends;
+        for (auto span : matcher.matches(text)) {
+            ends.push_back(span.end);
+        }
+        return ends;
+    }
+
+    void test_chunks() {
+        struct Case { char const* pattern; std::string text; };
+        std::vector<Case> cases = {
+            {"abc", "abcabc xabc ab"},
+            {"a{2,3}", "aaaaaaa baa"},
+            {"\\d{3}-\\d{4}", "call 555-1234 or 555-98765"},
+            {"(ab){2,4}c", "abababababc abc ababc"},
+            {"a$", "aaa"},
+            {"^a", "aaa"},
+            {"x*", "abx"},
+            {"b$|ab", "abab"},
+        };
+        for (auto const& c : cases) {
+            CSA::Matcher matcher(c.pattern);
+            auto expected = matcher_ends(matcher, c.text);
+            CHECK(expected.size() == matcher.count(c.text));
+            for (size_t chunk : {1, 2, 3, 7, 1000}) {
+                if (!CHECK(stream_ends(matcher, c.text, chunk) == expected)) {
+                    std::cerr << "  pattern " << c.pattern << ", chunks of " << chunk << "\n";
+                }
+            }
+        }
+    }
+
+    void test_waits_for_input() {
+        CSA::Matcher matcher("ab");
+        auto stream = CSA::stream_matches(matcher.config());
+        CHECK(!stream.next());
+        std::string first = "xa";
+        stream.feed(first);
+        CHECK(!stream.next());
+        CHECK(!stream.done());
+        std::string second = "bab";
+        stream.feed(second);
+        CHECK(stream.next() == std::optional<uint64_t>(3));
+        CHECK(stream.next() == std::optional<uint64_t>(5));
+        CHECK(!stream.next());
+        stream.close();
+        CHECK(!stream.next());
+        CHECK(stream.done());
+    }
+
+    void test_move() {
+        CSA::Matcher matcher("a");
+        auto stream = CSA::stream_matches(matcher.config());
+        CSA::MatchStream moved = std::move(stream);
+        CHECK(stream.done());
+        std::string text = "ba";
+        moved.feed(text);
+        CHECK(moved.next() == std::optional<uint64_t>(2));
+        stream = std::move(moved);
+        stream.close();
+        CHECK(!stream.next());
+        CHECK(stream.done());
+    }
+
+} // namespace
+
+int main() {
+    test_chunks();
+    test_waits_for_input();
+    test_move();
+    return test::result();
+}
@@ -0,0 +1,108 @@
+import json
+import os
+import signal
+import socket
+import subprocess
+import time
+import pytest
+from pathlib import Path
+from .conftest import run_cli
+
+LINES = ["HI", "hi", "Hi", "say hello", "HELLO there", "555-1234", "nothing", "hi hi"]
+
+PATTERNS = ["(?i)hi", "hi", "(?i)hello", r"\d{3}-\d{4}", "h.", "x*", "^hi$"]
+
+# number of lines each pattern finds, as Python's re counts them
+EXPECTED = [5, 3, 2, 1, 5, 8, 1]
+
+@pytest.fixture
+def files(tmp_path):
+    text = tmp_path / "text.txt"
+    text.write_text("\n".join(LINES) + "\n")
+    patterns = tmp_path / "patterns.txt"
+    patterns.write_text("\n".join(PATTERNS) + "\n")
+    return patterns, text
+
+def tsv_counts(output):
+    rows = [line.split("\t") for line in output.splitlines()]
+    assert [row[0] for row in rows] == PATTERNS
+    return [int(row[1]) for row in rows]
+
+@pytest.mark.cli
+class TestLinesPatterns:
+    def test_single_pattern(self, files):
+        _, text = files
+        for pattern, expected in zip(PATTERNS, EXPECTED):
+            assert run_cli("lines", pattern, text) == f"{expected}\n"
+
+    def test_tsv(self, files):
+        patterns, text = files
+        assert tsv_counts(run_cli("lines", "--patterns", patterns, text)) == EXPECTED
+        assert tsv_counts(run_cli("lines", "--patterns", patterns, "--format", "tsv", text)) == EXPECTED
+
+    def test_json(self, files):
+        patterns, text = files
+        output = json.loads(run_cli("lines", "--patterns", patterns, "--format", "json", text))
+        assert [entry["pattern"] for entry in output] == PATTERNS
+        assert [entry["count"] for entry in output] == EXPECTED
+
+    def test_prefilter(self, files):
+        patterns, text = files
+        output = run_cli("lines", "--patterns", patterns, "--prefilter", text)
+        assert tsv_counts(output) == EXPECTED
+        output = json.loads(run_cli("lines", "--patterns", patterns, "--prefilter", "--format", "json", text))
+        assert [entry["count"] for entry in output] == EXPECTED
+
+    def test_json_escape(self, tmp_path):
+        patterns = tmp_path / "patterns.txt"
+        patterns.write_text('"q"\n\\d\\\\\nx\ty\ncaf\u00e9\n', encoding="utf-8")
+        text = tmp_path / "text.txt"
+        text.write_text('say "q"\n1\\\nx\ty\ncaf\u00e9\n', encoding="utf-8")
+        output = json.loads(run_cli("lines", "--patterns", patterns, "--format", "json", text))
+        assert output == [{"pattern": '"q"', "count": 1}, {"pattern": "\\d\\\\", "count": 1},
+                          {"pattern": "x\ty", "count": 1}, {"pattern": "caf\u00e9", "count": 1}]
+
+    def test_tsv_rejects_tab(self, tmp_path):
+        patterns = tmp_path / "patterns.txt"
+        patterns.write_text("a\nx\ty\n")
+        text = tmp_path / "text.txt"
+        text.write_text("x\ty\n")
+        cli = Path(__file__).parent.parent / "build" / "ca_cli"
+        result = subprocess.run([str(cli), "lines", "--patterns", str(patterns), str(text)],
+                                capture_output=True, text=True)
+        assert result.returncode != 0 and "tab" in result.stderr
+        assert result.stdout == ""
+
+    def test_shared_cache(self, files):
+        _, text = files
+        name = f"/csa_test_cli_{os.getpid()}"
+        try:
+            # the second run starts from the states published by the first one
+            for _ in range(2):
+                assert run_cli("lines", "--shared-cache", name, PATTERNS[3], text) == f"{EXPECTED[3]}\n"
+        finally:
+            if os.path.exists(f"/dev/shm{name}"):
+                os.unlink(f"/dev/shm{name}")
+
+@pytest.mark.cli
+class TestServe:
+    @pytest.mark.parametrize("sig", [signal.SIGINT, signal.SIGTERM])
+    def test_signal_removes_socket(self, tmp_path, sig):
+        path = tmp_path / "serve.sock"
+        cli = Path(__file__).parent.parent / "build" / "ca_cli"
+        server = subprocess.Popen([str(cli), "serve", "--socket", str(path)])
+        try:
+            for _ in range(100):
+                if path.exists():
+                    break
+                time.sleep(0.05)
+            # a connection left open does not keep the server alive
+            client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            client.connect(str(path))
+            server.send_signal(sig)
+            assert server.wait(timeout=10) == 0
+            assert not path.exists()
+            client.close()
+        finally:
+            if server.poll() is None:
+                server.kill()
@@ -1,5 +1,5 @@
 import pytest
-from .conftest import check_match
+from .conftest import check_match, check_count, cache_stats, cache_lib, check_scan, check_budget
 
 @pytest.mark.basic
 class TestBasicMatching:
@@ -144,3 +144,86 @@ class TestComplex:
         check_match(pattern, "2023-10-24", True)
         check_match(pattern, "2023-1-24", False)
         check_match(pattern, "2023-10-244", False)
+
+@pytest.mark.count
+class TestCount:
+    def test_count_literal(self):
+        check_count("abc", "abcabc xabc", 3)
+        check_count("abc", "ab", 0)
+
+    def test_count_non_overlapping(self):
+        check_count("aa", "aaaaa", 2)
+        check_count("a{2,3}", "aaaaaaa", 3)
+
+    def test_count_counters(self):
+        check_count(r"\d{3}-\d{4}", "call 555-1234 or 555-98765", 2)
+        check_count(r"\d{3}-\d{4}", "555-123", 0)
+
+    def test_count_end_anchor(self):
+        check_count("a$", "ab", 0)
+        check_count("a$", "aaa", 1)
+        check_count("a$", "ba", 1)
+        check_count(r"\d{2}$", "12 34 56", 1)
+        check_count("b$|ab", "abab", 2)
+
+    def test_count_start_anchor(self):
+        check_count("^a", "aaa", 1)
+        check_count("^a", "ba", 0)
+        check_count("^a{2}", "aaaaaa", 1)
+        check_count("^a$", "a", 1)
+        check_count("^a$", "aa", 0)
+
+@pytest.mark.cache
+class TestCache:
+    def test_cache_hits(self):
+        check_match("c{2}ached", "xccached", True)
+        hits, misses, _ = cache_stats()
+        check_match("c{2}ached", "cached", False)
+        assert cache_stats()[:2] == (hits + 1, misses)
+
+    def test_cache_evictions(self):
+        lib = cache_lib()
+        lib.csa_cache_clear()
+        lib.csa_cache_set_capacity(2)
+        try:
+            _, _, evictions = cache_stats()
+            for pattern in ["e1", "e2", "e3"]:
+                check_match(pattern, pattern, True)
+            assert cache_stats()[2] == evictions + 1
+        finally:
+            lib.csa_cache_set_capacity(256)
+
+    def test_cached_handle(self):
+        lib = cache_lib()
+        handle = lib.csa_compile_cached(b"h[0-9]{2}")
+        assert handle
+        try:
+            lib.csa_cache_clear()
+            assert lib.csa_match_cached(handle, b"h42") == 1
+            assert lib.csa_match_cached(handle, b"h4") == 0
+        finally:
+            lib.csa_release_cached(handle)
+        assert not lib.csa_compile_cached(b"(")
+
+@pytest.mark.budget
+class TestMemoryBudget:
+    def test_memory_budget(self):
+        texts = ["ab" * n + "c" + "ba" * (n % 7) + "c" for n in range(40)]
+        assert check_budget("(ab|ba){2,5}c", texts, 1024) > 0
+        assert check_budget("(ab|ba){2,5}c", texts, 0) == 0
+
+    def test_shared_program_budget(self):
+        texts = ["ab" * n + "c" + "ba" * (n % 7) + "c" for n in range(40)]
+        expected = [n >= 2 for n in range(40)]
+        assert check_scan("(ab|ba){2,5}c", texts, expected, threads=8, budget=1024) > 0
+        assert check_scan("(ab|ba){2,5}c", texts, expected, threads=8) == 0
+
+@pytest.mark.scan
+class TestScan:
+    def test_scan_shared_program(self):
+        texts = ["x" * 50 + "ab" * 3, "ab" * 2, "abab ab", "", "zzababab"]
+        check_scan("(ab){3}", texts, [True, False, False, False, True])
+
+    def test_scan_counters(self):
+        texts = ["2023-10-24", "2023-1-24", "on 1999-12-31."]
+        check_scan(r"\d{4}-\d{2}-\d{2}", texts, [True, False, True], threads=8)
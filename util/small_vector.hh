@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace CSA {
+
+    // Vector of trivially destructible values that keeps up to N of them
+    // inline, the inline buffer shares the storage with the pointer to the heap.
+    template<typename T, uint32_t N>
+    class SmallVector {
+        static_assert(std::is_trivially_destructible_v<T> && N > 0);
+
+        public:
+        using value_type = T;
+        using iterator = T*;
+        using const_iterator = T const*;
+
+        SmallVector() : size_(0), capacity_(N) {}
+        SmallVector(std::initializer_list<T> values) : SmallVector() {
+            for (auto const& value : values) {
+                push_back(value);
+            }
+        }
+        SmallVector(SmallVector const& other) : size_(0), capacity_(N) { *this = other; }
+        SmallVector(SmallVector&& other) noexcept : size_(0), capacity_(N) { *this = std::move(other); }
+        ~SmallVector() {
+            if (!is_inline()) {
+                std::allocator<T>().deallocate(heap_, capacity_);
+            }
+        }
+
+        SmallVector& operator=(SmallVector const& other) {
+            if (this != &other) {
+                size_ = 0;
+                reserve(other.size_);
+                std::uninitialized_copy(other.begin(), other.end(), data());
+                size_ = other.size_;
+            }
+            return *this;
+        }
+
+        SmallVector& operator=(SmallVector&& other) noexcept {
+            if (this == &other) {
+                return *this;
+            }
+            if (other.is_inline()) {
+                *this = static_cast<SmallVector const&>(other);
+            } else {
+                if (!is_inline()) {
+                    std::allocator<T>().deallocate(heap_, capacity_);
+                }
+                heap_ = other.heap_;
+                capacity_ = other.capacity_;
+                size_ = other.size_;
+                other.capacity_ = N;
+            }
+            other.size_ = 0;
+            return *this;
+        }
+
+        T* data() { return is_inline() ? inline_ : heap_; }
+        T const* data() const { return is_inline() ? inline_ : heap_; }
+        iterator begin() { return data(); }
+        iterator end() { return data() + size_; }
+        const_iterator begin() const { return data(); }
+        const_iterator end() const { return data() + size_; }
+
+        uint32_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        T& operator[](uint32_t i) { assert(i < size_); return data()[i]; }
+        T const& operator[](uint32_t i) const { assert(i < size_); return data()[i]; }
+        T& back() { assert(size_ > 0); return data()[size_ - 1]; }
+        T const& back() const { assert(size_ > 0); return data()[size_ - 1]; }
+
+        void clear() { size_ = 0; }
+
+        void reserve(uint32_t capacity) {
+            if (capacity <= capacity_) {
+                return;
+            }
+            T* heap = std::allocator<T>().allocate(capacity);
+            std::uninitialized_copy(begin(), end(), heap);
+            if (!is_inline()) {
+                std::allocator<T>().deallocate(heap_, capacity_);
+            }
+            heap_ = heap;
+            capacity_ = capacity;
+        }
+
+        void push_back(T const& value) {
+            if (size_ == capacity_) {
+                // the value can be in the buffer that is reallocated
+                T copy = value;
+                reserve(2 * capacity_);
+                ::new (data() + size_++) T(copy);
+            } else {
+                ::new (data() + size_++) T(value);
+            }
+        }
+
+        iterator insert(const_iterator pos, T const& value) {
+            uint32_t i = pos - begin();
+            if (i == size_) {
+                push_back(value);
+                return end() - 1;
+            }
+            T copy = value;
+            push_back(back());
+            T* values = data();
+            std::copy_backward(values + i, values + size_ - 2, values + size_ - 1);
+            values[i] = copy;
+            return values + i;
+        }
+
+        bool operator==(SmallVector const& other) const {
+            return std::equal(begin(), end(), other.begin(), other.end());
+        }
+
+        private:
+        bool is_inline() const { return capacity_ == N; }
+
+        uint32_t size_;
+        uint32_t capacity_;
+        union {
+            T inline_[N];
+            T* heap_;
+        };
+    };
+
+} // namespace CSA